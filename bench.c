@@ -0,0 +1,369 @@
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// synthetic workloads against a fresh disk each, reporting throughput and latency percentiles of every operation -
+// gcc -O2 -pthread bench.c fs.c compress.c -o bench, then ./bench -h for the options
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct bench_options {
+    long long disk_size; // bytes of data blocks
+    int block_size;
+    int operations; // operations of the churn and random read workloads, files of the small file workload
+    char* directory; // where the disk file and the generated files go
+    FS_OPTIONS fs_options;
+} BENCH_OPTIONS;
+
+// latencies of one kind of operation in a workload
+typedef struct samples {
+    const char* workload;
+    const char* operation;
+    double* seconds;
+    int count;
+    long long bytes;
+    double total;
+} SAMPLES;
+
+static unsigned long long random_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned long long next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// the file system prints what some commands did, the benchmark only wants its own table
+static int saved_stdout = -1;
+
+static void quiet(int on) {
+    fflush(stdout);
+    if (on) {
+        saved_stdout = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    } else {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+}
+
+static void samples_init(SAMPLES* samples, const char* workload, const char* operation) {
+    memset(samples, 0, sizeof(SAMPLES));
+    samples->workload = workload;
+    samples->operation = operation;
+    samples->seconds = (double*) malloc(sizeof(double) * MAX_SAMPLES);
+}
+
+static void samples_add(SAMPLES* samples, double seconds, long long bytes) {
+    if (samples->count < MAX_SAMPLES) {
+        samples->seconds[samples->count++] = seconds;
+    }
+    samples->bytes += bytes;
+    samples->total += seconds;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of the sorted latencies
+static double percentile(SAMPLES* samples, double fraction) {
+    int rank = (int) (fraction * samples->count + 0.999999);
+    rank = rank < 1 ? 1 : rank;
+    return samples->seconds[rank - 1];
+}
+
+static void samples_report(SAMPLES* samples) {
+    if (samples->count > 0) {
+        qsort(samples->seconds, samples->count, sizeof(double), compare_doubles);
+        printf("%-8s %-10s %8d %10.3f %12.1f %10.1f %10.3f %10.3f %10.3f\n", samples->workload, samples->operation, samples->count,
+               samples->total, samples->count / samples->total, samples->bytes / (double) (1 << 20) / samples->total,
+               percentile(samples, 0.5) * 1e3, percentile(samples, 0.99) * 1e3, samples->seconds[samples->count - 1] * 1e3);
+    }
+    free(samples->seconds);
+}
+
+// a file of size bytes that compresses about as well as ordinary data, half of each 4 KiB repeats
+static void make_file(char* path, long long size) {
+    FILE* file = fopen(path, "w");
+    char buffer[4096];
+    for (long long written = 0; written < size; written += sizeof(buffer)) {
+        for (int i = 0; i < (int) sizeof(buffer); i += 8) {
+            unsigned long long value = i < (int) sizeof(buffer) / 2 ? next_random() : 0x2020202020202020ULL + i;
+            memcpy(buffer + i, &value, 8);
+        }
+        fwrite(buffer, 1, size - written < (long long) sizeof(buffer) ? size - written : (long long) sizeof(buffer), file);
+    }
+    fclose(file);
+}
+
+static FS* create_disk(BENCH_OPTIONS* options, char* disk, int inodes) {
+    quiet(1);
+    FS* fs = init_fs(disk, options->disk_size / options->block_size, options->block_size, inodes, &options->fs_options);
+    quiet(0);
+    if (fs == NULL) {
+        printf("Error: could not create %s.\n", disk);
+    }
+    return fs;
+}
+
+// copy many small files in one at a time, then read each of them back
+static void bench_small(BENCH_OPTIONS* options, char* directory, char* disk) {
+    int count = options->operations;
+    long long average = 16 << 10;
+    count = (long long) count * average * 2 > options->disk_size ? options->disk_size / average / 2 : count;
+    FS* fs = create_disk(options, disk, count + 16);
+    if (fs == NULL) {
+        return;
+    }
+    SAMPLES copies, gets;
+    samples_init(&copies, "small", "copy");
+    samples_init(&gets, "small", "get");
+    char path[4096], name[64], output[4096];
+    long long* sizes = (long long*) malloc(sizeof(long long) * count);
+    for (int i = 0; i < count; i++) {
+        sizes[i] = 512 + next_random() % (2 * average - 512);
+        snprintf(path, sizeof(path), "%s/small%d", directory, i);
+        make_file(path, sizes[i]);
+    }
+    quiet(1);
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/small%d", directory, i);
+        snprintf(name, sizeof(name), "/small%d", i);
+        double started = now_seconds();
+        copy_file_to_fs(fs, path, name);
+        samples_add(&copies, now_seconds() - started, sizes[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "/small%d", i);
+        snprintf(output, sizeof(output), "%s/out", directory);
+        double started = now_seconds();
+        copy_file_from_fs(fs, name, output);
+        samples_add(&gets, now_seconds() - started, sizes[i]);
+    }
+    quiet(0);
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/small%d", directory, i);
+        unlink(path);
+    }
+    unlink(output);
+    free(sizes);
+    close_fs(fs);
+    samples_report(&copies);
+    samples_report(&gets);
+}
+
+// copy a few files of an eighth of the disk each in and out again
+static void bench_huge(BENCH_OPTIONS* options, char* directory, char* disk) {
+    FS* fs = create_disk(options, disk, 16);
+    if (fs == NULL) {
+        return;
+    }
+    int count = 4;
+    long long size = options->disk_size / 8;
+    SAMPLES copies, gets;
+    samples_init(&copies, "huge", "copy");
+    samples_init(&gets, "huge", "get");
+    char path[4096], name[64], output[4096];
+    snprintf(path, sizeof(path), "%s/huge", directory);
+    snprintf(output, sizeof(output), "%s/out", directory);
+    make_file(path, size);
+    quiet(1);
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "/huge%d", i);
+        double started = now_seconds();
+        copy_file_to_fs(fs, path, name);
+        samples_add(&copies, now_seconds() - started, size);
+    }
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "/huge%d", i);
+        double started = now_seconds();
+        copy_file_from_fs(fs, name, output);
+        samples_add(&gets, now_seconds() - started, size);
+    }
+    quiet(0);
+    unlink(path);
+    unlink(output);
+    close_fs(fs);
+    samples_report(&copies);
+    samples_report(&gets);
+}
+
+// keep the disk about half full with files coming and going, defragmenting part of it every 100 operations
+static void bench_churn(BENCH_OPTIONS* options, char* directory, char* disk) {
+    int slots = 256;
+    FS* fs = create_disk(options, disk, slots + 16);
+    if (fs == NULL) {
+        return;
+    }
+    long long max_size = options->disk_size / slots < (4 << 20) ? options->disk_size / slots : (4 << 20);
+    SAMPLES copies, removes, defrags;
+    samples_init(&copies, "churn", "copy");
+    samples_init(&removes, "churn", "remove");
+    samples_init(&defrags, "churn", "defrag");
+    char path[4096], name[64];
+    int sources = 16;
+    long long source_sizes[16];
+    for (int i = 0; i < sources; i++) {
+        source_sizes[i] = 1 + next_random() % max_size;
+        snprintf(path, sizeof(path), "%s/churn%d", directory, i);
+        make_file(path, source_sizes[i]);
+    }
+    char* present = (char*) calloc(slots, 1);
+    long long stored = 0;
+    quiet(1);
+    for (int i = 0; i < options->operations; i++) {
+        int slot = next_random() % slots;
+        snprintf(name, sizeof(name), "/file%d", slot);
+        if (!present[slot] && stored < options->disk_size / 2) {
+            int source = next_random() % sources;
+            snprintf(path, sizeof(path), "%s/churn%d", directory, source);
+            double started = now_seconds();
+            if (copy_file_to_fs(fs, path, name) == 0) {
+                present[slot] = 1 + source;
+                stored += source_sizes[source];
+            }
+            samples_add(&copies, now_seconds() - started, source_sizes[source]);
+        } else if (present[slot]) {
+            double started = now_seconds();
+            delete_file(fs, name);
+            samples_add(&removes, now_seconds() - started, 0);
+            stored -= source_sizes[present[slot] - 1];
+            present[slot] = 0;
+        }
+        if (i % 100 == 99) {
+            double started = now_seconds();
+            defragment_fs(fs, fs->superblock.total_data_blocks / 16);
+            samples_add(&defrags, now_seconds() - started, 0);
+        }
+    }
+    quiet(0);
+    for (int i = 0; i < sources; i++) {
+        snprintf(path, sizeof(path), "%s/churn%d", directory, i);
+        unlink(path);
+    }
+    free(present);
+    close_fs(fs);
+    samples_report(&copies);
+    samples_report(&removes);
+    samples_report(&defrags);
+}
+
+// 4 KiB reads at random offsets of a file of a quarter of the disk, then the whole file in 1 MiB reads
+static void bench_random(BENCH_OPTIONS* options, char* directory, char* disk) {
+    FS* fs = create_disk(options, disk, 16);
+    if (fs == NULL) {
+        return;
+    }
+    long long size = options->disk_size / 4;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/random", directory);
+    make_file(path, size);
+    quiet(1);
+    copy_file_to_fs(fs, path, "/random");
+    quiet(0);
+    unlink(path);
+    SAMPLES reads, scans;
+    samples_init(&reads, "random", "read 4K");
+    samples_init(&scans, "random", "read 1M");
+    char* buffer = (char*) malloc(1 << 20);
+    for (int i = 0; i < options->operations; i++) {
+        long long offset = size > 4096 ? next_random() % (size - 4096) : 0;
+        double started = now_seconds();
+        long long got = read_file_at(fs, "/random", offset, buffer, 4096);
+        samples_add(&reads, now_seconds() - started, got > 0 ? got : 0);
+    }
+    for (long long offset = 0; offset < size; offset += 1 << 20) {
+        double started = now_seconds();
+        long long got = read_file_at(fs, "/random", offset, buffer, 1 << 20);
+        samples_add(&scans, now_seconds() - started, got > 0 ? got : 0);
+    }
+    free(buffer);
+    close_fs(fs);
+    samples_report(&reads);
+    samples_report(&scans);
+}
+
+static void print_usage(void) {
+    printf("Usage: bench [-s disk MiB] [-b block size] [-n operations] [-d directory] [-w small|huge|churn|random|all] [-m] [-c none|fast|high] [-u] [-t threads] [-j]\n");
+    printf("  -m uses the mmap backend, -c compresses the copied files, -u deduplicates them, -j prints the counters as JSON after the table\n");
+}
+
+int main(int argc, char** argv) {
+    BENCH_OPTIONS options = {256LL << 20, DEFAULT_BLOCK_SIZE, 2000, "/tmp", {BACKEND_FILE, DEFAULT_BATCH, 0, DEFAULT_CACHE_SIZE, CODEC_NONE, 0}};
+    char* workload = "all";
+    int json = 0;
+    int option;
+    while ((option = getopt(argc, argv, "s:b:n:d:w:mc:ut:jh")) != -1) {
+        if (option == 's') {
+            options.disk_size = atoll(optarg) << 20;
+        } else if (option == 'b') {
+            options.block_size = atoi(optarg);
+        } else if (option == 'n') {
+            options.operations = atoi(optarg);
+        } else if (option == 'd') {
+            options.directory = optarg;
+        } else if (option == 'w') {
+            workload = optarg;
+        } else if (option == 'm') {
+            options.fs_options.backend = BACKEND_MMAP;
+        } else if (option == 'c') {
+            options.fs_options.compress = strcmp(optarg, "fast") == 0 ? CODEC_FAST : strcmp(optarg, "high") == 0 ? CODEC_HIGH : CODEC_NONE;
+        } else if (option == 'u') {
+            options.fs_options.dedup = 1;
+        } else if (option == 't') {
+            options.fs_options.threads = atoi(optarg);
+        } else if (option == 'j') {
+            json = 1;
+        } else {
+            print_usage();
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (options.disk_size < (1 << 20) || options.block_size < MIN_BLOCK_SIZE || options.operations <= 0) {
+        print_usage();
+        return 1;
+    }
+    char directory[4096];
+    snprintf(directory, sizeof(directory), "%s/bench-XXXXXX", options.directory);
+    if (mkdtemp(directory) == NULL) {
+        printf("Error: could not create a directory in %s.\n", options.directory);
+        return 1;
+    }
+    char disk[sizeof(directory) + 8];
+    snprintf(disk, sizeof(disk), "%s/disk", directory);
+    printf("%-8s %-10s %8s %10s %12s %10s %10s %10s %10s\n", "workload", "operation", "count", "seconds", "ops/s", "MiB/s", "p50 ms", "p99 ms", "max ms");
+    void (*workloads[])(BENCH_OPTIONS*, char*, char*) = {bench_small, bench_huge, bench_churn, bench_random};
+    const char* names[] = {"small", "huge", "churn", "random"};
+    int ran = 0;
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(workload, "all") == 0 || strcmp(workload, names[i]) == 0) {
+            workloads[i](&options, directory, disk);
+            unlink(disk);
+            ran = 1;
+        }
+    }
+    rmdir(directory);
+    if (!ran) {
+        print_usage();
+        return 1;
+    }
+    if (json) {
+        print_stats(NULL);
+    }
+    return 0;
+}
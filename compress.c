@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include "compress.h"
+
+// a block is a list of sequences, each one a token, literals copied as they are and a match copied from up to MAX_DISTANCE
+// bytes back - the token holds the literal length and the match length less MIN_MATCH, 15 means more length bytes follow
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the last bytes of a block are always literals
+#define MATCH_LIMIT 12 // no match starts closer than this to the end of the block
+#define MAX_DISTANCE 65535
+#define FAST_HASH_BITS 12
+#define HIGH_HASH_BITS 16
+#define HIGH_ATTEMPTS 64 // candidates CODEC_HIGH compares at each position
+
+static unsigned int read32(const unsigned char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static unsigned int hash4(const unsigned char* p, int bits) {
+    return (read32(p) * 2654435761u) >> (32 - bits);
+}
+
+// number of equal bytes at a and b, b stops at limit
+static int common_length(const unsigned char* a, const unsigned char* b, const unsigned char* limit) {
+    const unsigned char* start = b;
+    while (b + 8 <= limit) {
+        unsigned long long x, y;
+        memcpy(&x, a, 8);
+        memcpy(&y, b, 8);
+        if (x != y) {
+            return b - start + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+    while (b < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+static unsigned char* write_length(unsigned char* out, int length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+// append literal_length literals and, unless match_length is 0, a match - returns the new end of out or NULL if it does not fit
+static unsigned char* write_sequence(unsigned char* out, unsigned char* out_end, const unsigned char* literals, int literal_length, int distance, int match_length) {
+    if (out_end - out < 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1) {
+        return NULL;
+    }
+    unsigned char* token = out++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        out = write_length(out, literal_length - 15);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return out;
+    }
+    *out++ = distance & 255;
+    *out++ = distance >> 8;
+    int length = match_length - MIN_MATCH;
+    *token |= length < 15 ? length : 15;
+    if (length >= 15) {
+        out = write_length(out, length - 15);
+    }
+    return out;
+}
+
+int compress_block(int codec, const char* source, int length, char* destination, int capacity) {
+    const unsigned char* input = (const unsigned char*) source;
+    const unsigned char* end = input + length;
+    const unsigned char* anchor = input; // first byte not written yet
+    unsigned char* out = (unsigned char*) destination;
+    unsigned char* out_end = out + capacity;
+    if (length > MATCH_LIMIT) {
+        // positions of earlier data by hash of their first 4 bytes, CODEC_HIGH also chains the earlier positions with the same hash
+        int bits = codec == CODEC_HIGH ? HIGH_HASH_BITS : FAST_HASH_BITS;
+        int* heads = (int*) malloc(sizeof(int) << bits);
+        int* chain = codec == CODEC_HIGH ? (int*) malloc(sizeof(int) * (MAX_DISTANCE + 1)) : NULL;
+        memset(heads, -1, sizeof(int) << bits);
+        const unsigned char* match_limit = end - MATCH_LIMIT;
+        const unsigned char* match_end = end - LAST_LITERALS;
+        const unsigned char* p = input;
+        int inserted = 0; // positions before this one are in the chains
+        int misses = 0;
+        while (p <= match_limit) {
+            int position = p - input;
+            int best_length = 0;
+            int best = -1;
+            if (chain == NULL) {
+                unsigned int hash = hash4(p, bits);
+                int candidate = heads[hash];
+                heads[hash] = position;
+                if (candidate >= 0 && position - candidate <= MAX_DISTANCE && read32(input + candidate) == read32(p)) {
+                    best = candidate;
+                    best_length = MIN_MATCH + common_length(input + candidate + MIN_MATCH, p + MIN_MATCH, match_end);
+                }
+            } else {
+                for (; inserted <= position; inserted++) {
+                    unsigned int hash = hash4(input + inserted, bits);
+                    chain[inserted & MAX_DISTANCE] = heads[hash];
+                    heads[hash] = inserted;
+                }
+                int candidate = chain[position & MAX_DISTANCE];
+                for (int attempt = 0; attempt < HIGH_ATTEMPTS && candidate >= 0 && position - candidate <= MAX_DISTANCE; attempt++) {
+                    if (read32(input + candidate) == read32(p)) {
+                        int candidate_length = MIN_MATCH + common_length(input + candidate + MIN_MATCH, p + MIN_MATCH, match_end);
+                        if (candidate_length > best_length) {
+                            best_length = candidate_length;
+                            best = candidate;
+                        }
+                    }
+                    candidate = chain[candidate & MAX_DISTANCE];
+                }
+            }
+            if (best_length < MIN_MATCH) {
+                p += 1 + (misses++ >> 6); // skip faster through data that does not compress
+                continue;
+            }
+            const unsigned char* match = input + best;
+            while (p > anchor && match > input && p[-1] == match[-1]) {
+                p--;
+                match--;
+                best_length++;
+            }
+            out = write_sequence(out, out_end, anchor, p - anchor, p - match, best_length);
+            if (out == NULL) {
+                break;
+            }
+            p += best_length;
+            anchor = p;
+            misses = 0;
+        }
+        free(heads);
+        free(chain);
+        if (out == NULL) {
+            return 0;
+        }
+    }
+    out = write_sequence(out, out_end, anchor, end - anchor, 0, 0);
+    return out == NULL ? 0 : (char*) out - destination;
+}
+
+int decompress_block(const char* source, int length, char* destination, int capacity) {
+    const unsigned char* in = (const unsigned char*) source;
+    const unsigned char* in_end = in + length;
+    unsigned char* out = (unsigned char*) destination;
+    unsigned char* out_end = out + capacity;
+    while (in < in_end) {
+        int token = *in++;
+        long long literal_length = token >> 4;
+        if (literal_length == 15) {
+            int byte;
+            do {
+                if (in == in_end) {
+                    return -1;
+                }
+                byte = *in++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > in_end - in || literal_length > out_end - out) {
+            return -1;
+        }
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end) {
+            break; // the last sequence has no match
+        }
+        if (in_end - in < 2) {
+            return -1;
+        }
+        int distance = in[0] | in[1] << 8;
+        in += 2;
+        long long match_length = token & 15;
+        if (match_length == 15) {
+            int byte;
+            do {
+                if (in == in_end) {
+                    return -1;
+                }
+                byte = *in++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += MIN_MATCH;
+        if (distance == 0 || distance > out - (unsigned char*) destination || match_length > out_end - out) {
+            return -1;
+        }
+        const unsigned char* match = out - distance;
+        if (distance >= match_length) {
+            memcpy(out, match, match_length);
+        } else {
+            // the match overlaps the bytes it produces, they repeat every distance bytes so the copy can double each time
+            memcpy(out, match, distance);
+            for (long long copied = distance; copied < match_length; copied *= 2) {
+                memcpy(out + copied, out, copied < match_length - copied ? copied : match_length - copied);
+            }
+        }
+        out += match_length;
+    }
+    return (char*) out - destination;
+}
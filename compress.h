@@ -0,0 +1,9 @@
+// block codecs for file data - both write the LZ4 block format, CODEC_HIGH searches longer for matches and compresses better
+#define CODEC_NONE 0
+#define CODEC_FAST 1
+#define CODEC_HIGH 2
+
+// compress length bytes of source into destination, returns the compressed length or 0 if it does not fit capacity bytes
+int compress_block(int codec, const char* source, int length, char* destination, int capacity);
+// returns the decompressed length, or -1 if source is damaged or does not fit capacity bytes
+int decompress_block(const char* source, int length, char* destination, int capacity);
@@ -1,415 +1,4102 @@
+#define _GNU_SOURCE // copy_file_range, fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "fs.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE __attribute__((target("sse4.2"))) // compiled in always, used when the processor has SSE4.2
+#endif
 
-SUPERBLOCK* superblock;
-INODE* inodes;
-DATA_BLOCK* data_blocks;
+_Static_assert(sizeof(SUPERBLOCK) <= PAGE_SIZE, "superblock must fit in its page");
+_Static_assert(sizeof(INODE) == 256, "inode size is part of the disk format");
+_Static_assert(sizeof(BLOCK_META) == 16, "block table entry size is part of the disk format");
+_Static_assert(sizeof(DIR_ENTRY) == 36, "directory entry size is part of the disk format");
+_Static_assert(2 * COMPRESS_CHUNK <= IO_SIZE, "a transfer buffer holds a frame before and after compression");
+_Static_assert(sizeof(TRANSACTION) % 8 == 0 && sizeof(JOURNAL_RECORD) % 8 == 0, "journal records are 8 byte aligned");
 
-void init_fs(char* fs_name, int blocks) {
-    FILE* fs = fopen(fs_name, "w");
+static int check_selected(FS* fs) {
     if (fs == NULL) {
+        printf("Error: no file system selected.\n");
+        return 0;
+    }
+    return 1;
+}
+
+static long long align_to_page(long long offset) {
+    return (offset + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+// place the bitmap, block table, inode table, journal and data area of a file system described by superblock
+static void compute_layout(SUPERBLOCK* superblock) {
+    long long bitmap_size = (superblock->total_data_blocks + 63) / 64 * sizeof(unsigned long long);
+    superblock->bitmap_offset = PAGE_SIZE;
+    superblock->block_table_offset = align_to_page(superblock->bitmap_offset + bitmap_size);
+    superblock->inodes_offset = align_to_page(superblock->block_table_offset + sizeof(BLOCK_META) * (long long) superblock->total_data_blocks);
+    long long inodes_end = superblock->inodes_offset + sizeof(INODE) * (long long) superblock->total_inodes;
+    superblock->journal_offset = superblock->journal_size > 0 ? align_to_page(inodes_end) : 0;
+    superblock->data_offset = align_to_page(superblock->journal_size > 0 ? superblock->journal_offset + superblock->journal_size : inodes_end);
+    superblock->total_size = superblock->data_offset + (long long) superblock->block_size * superblock->total_data_blocks;
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+static FS_STATS stats;
+
+// counters are added to from the transfer threads too
+static void count_stat(long long* counter, long long value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static long block_offset(FS* fs, int block_index) {
+    return fs->superblock.data_offset + (long) fs->superblock.block_size * block_index;
+}
+
+// pread and pwrite may transfer less than asked, repeat until done or the file ends
+static long long pread_all(int fd, void* buffer, long long size, long long offset) {
+    long long done = 0;
+    while (done < size) {
+        ssize_t count = pread(fd, (char*) buffer + done, size - done, offset + done);
+        count_stat(&stats.read_calls, 1);
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+    count_stat(&stats.bytes_read, done);
+    return done;
+}
+
+static long long pwrite_all(int fd, void* buffer, long long size, long long offset) {
+    long long done = 0;
+    while (done < size) {
+        ssize_t count = pwrite(fd, (char*) buffer + done, size - done, offset + done);
+        count_stat(&stats.write_calls, 1);
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+    count_stat(&stats.bytes_written, done);
+    return done;
+}
+
+// copy size bytes between two files inside the kernel - copy_file_range, then sendfile, then a buffered copy when neither works for this pair of files,
+// sendfile writes at the file position of out_fd so it is skipped when other threads write to out_fd too
+static long long copy_range(int in_fd, long long in_offset, int out_fd, long long out_offset, long long size, int shared_out) {
+    long long done = 0;
+    while (done < size) {
+        loff_t in_position = in_offset + done;
+        loff_t out_position = out_offset + done;
+        ssize_t count = copy_file_range(in_fd, &in_position, out_fd, &out_position, size - done, 0);
+        count_stat(&stats.copy_calls, 1);
+        if (count <= 0) {
+            break;
+        }
+        done += count;
+    }
+    if (done < size && !shared_out && lseek(out_fd, out_offset + done, SEEK_SET) != -1) {
+        while (done < size) {
+            off_t in_position = in_offset + done;
+            ssize_t count = sendfile(out_fd, in_fd, &in_position, size - done);
+            count_stat(&stats.copy_calls, 1);
+            if (count <= 0) {
+                break;
+            }
+            done += count;
+        }
+    }
+    count_stat(&stats.bytes_copied, done);
+    if (done < size) {
+        char* buffer = (char*) malloc(IO_SIZE);
+        while (done < size) {
+            long long count = size - done < IO_SIZE ? size - done : IO_SIZE;
+            count = pread_all(in_fd, buffer, count, in_offset + done);
+            if (count <= 0 || pwrite_all(out_fd, buffer, count, out_offset + done) != count) {
+                break;
+            }
+            done += count;
+        }
+        free(buffer);
+    }
+    return done;
+}
+
+// read size bytes at offset of the disk file, from the mapping when there is one
+static void disk_read(FS* fs, long long offset, void* buffer, long long size) {
+    if (fs->map != NULL) {
+        memcpy(buffer, fs->map + offset, size);
+    } else {
+        pread_all(fs->fd, buffer, size, offset);
+    }
+}
+
+static void disk_write(FS* fs, long long offset, void* buffer, long long size) {
+    if (fs->map != NULL) {
+        memcpy(fs->map + offset, buffer, size);
+    } else {
+        pwrite_all(fs->fd, buffer, size, offset);
+    }
+}
+
+// CRC32C, 8 bytes at a time through 8 tables built on first use, or with the crc32 instruction where the processor has it
+static unsigned int crc32c_tables[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int value = i;
+        for (int bit = 0; bit < 8; bit++) {
+            value = value & 1 ? (value >> 1) ^ 0x82f63b78 : value >> 1;
+        }
+        crc32c_tables[0][i] = value;
+    }
+    for (int table = 1; table < 8; table++) {
+        for (int i = 0; i < 256; i++) {
+            unsigned int value = crc32c_tables[table - 1][i];
+            crc32c_tables[table][i] = (value >> 8) ^ crc32c_tables[0][value & 0xff];
+        }
+    }
+}
+
+#ifdef CRC32C_HARDWARE
+static int crc32c_hardware(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+
+CRC32C_HARDWARE static unsigned int crc32c_instruction(unsigned int crc, unsigned char* bytes, long long length) {
+    unsigned long long value = crc;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = value;
+    for (; length > 0; length--) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+    }
+    return crc;
+}
+
+// the instruction has a latency of several cycles, so three blocks are summed side by side
+CRC32C_HARDWARE static void crc32c_three_blocks(char* data, int block_size, unsigned int* checksums) {
+    unsigned long long sums[3] = {0xffffffff, 0xffffffff, 0xffffffff};
+    for (int i = 0; i < block_size; i += 8) {
+        unsigned long long words[3];
+        memcpy(&words[0], data + i, 8);
+        memcpy(&words[1], data + block_size + i, 8);
+        memcpy(&words[2], data + 2 * block_size + i, 8);
+        sums[0] = _mm_crc32_u64(sums[0], words[0]);
+        sums[1] = _mm_crc32_u64(sums[1], words[1]);
+        sums[2] = _mm_crc32_u64(sums[2], words[2]);
+    }
+    for (int k = 0; k < 3; k++) {
+        checksums[k] = ~(unsigned int) sums[k];
+    }
+}
+#else
+static int crc32c_hardware(void) {
+    return 0;
+}
+#endif
+
+static unsigned int crc32c(unsigned int crc, void* data, long long length) {
+    unsigned char* bytes = (unsigned char*) data;
+    crc = ~crc;
+#ifdef CRC32C_HARDWARE
+    if (crc32c_hardware()) {
+        return ~crc32c_instruction(crc, bytes, length);
+    }
+#endif
+    pthread_once(&crc32c_once, crc32c_init);
+    unsigned int (*tables)[256] = crc32c_tables;
+    for (; length >= 8; length -= 8, bytes += 8) {
+        unsigned long long word;
+        memcpy(&word, bytes, 8); // the tables are for little-endian words
+        word ^= crc;
+        crc = tables[7][word & 0xff] ^ tables[6][word >> 8 & 0xff] ^ tables[5][word >> 16 & 0xff] ^ tables[4][word >> 24 & 0xff]
+            ^ tables[3][word >> 32 & 0xff] ^ tables[2][word >> 40 & 0xff] ^ tables[1][word >> 48 & 0xff] ^ tables[0][word >> 56];
+    }
+    for (; length > 0; length--) {
+        crc = tables[0][(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// checksums of count adjacent blocks
+static void checksum_blocks(FS* fs, char* data, int count, unsigned int* checksums) {
+    int block_size = fs->superblock.block_size;
+    int i = 0;
+#ifdef CRC32C_HARDWARE
+    for (; i + 3 <= count && crc32c_hardware(); i += 3) {
+        crc32c_three_blocks(data + (long long) i * block_size, block_size, checksums + i);
+    }
+#endif
+    for (; i < count; i++) {
+        checksums[i] = crc32c(0, data + (long long) i * block_size, block_size);
+    }
+    for (i = 0; i < count; i++) {
+        checksums[i] = checksums[i] != 0 ? checksums[i] : 1; // 0 marks blocks without a checksum
+    }
+    count_stat(&stats.bytes_checksummed, (long long) count * block_size);
+}
+
+// index of the first of count blocks from first_block whose data does not match its checksum, count if they all match
+static int verify_blocks(FS* fs, int first_block, char* data, int count) {
+    unsigned int checksums[48];
+    for (int i = 0; i < count; i += 48) {
+        int group = count - i < 48 ? count - i : 48;
+        checksum_blocks(fs, data + (long long) i * fs->superblock.block_size, group, checksums);
+        for (int j = 0; j < group; j++) {
+            unsigned int expected = fs->blocks[first_block + i + j].checksum;
+            if (expected != 0 && expected != checksums[j]) {
+                count_stat(&stats.checksum_errors, 1);
+                return i + j;
+            }
+        }
+    }
+    return count;
+}
+
+// read length bytes at offset in the data area and check the blocks they are in, returns the bytes read up to the first damaged
+// block or the end of a short read
+static long long checked_read(FS* fs, long long offset, char* buffer, long long length) {
+    int block_size = fs->superblock.block_size;
+    long long start = offset - (offset - fs->superblock.data_offset) % block_size;
+    long long tail = (offset + length - fs->superblock.data_offset) % block_size;
+    long long end = offset + length + (tail != 0 ? block_size - tail : 0);
+    int first_block = (start - fs->superblock.data_offset) / block_size;
+    int count = (end - start) / block_size;
+    char* data = fs->map != NULL ? fs->map + start : start == offset && end == offset + length ? buffer : (char*) malloc(end - start);
+    long long got = length <= 0 ? 0 : fs->map != NULL ? end - start : pread_all(fs->fd, data, end - start, start);
+    if (got != end - start) {
+        count = got / block_size; // a short read only keeps the whole blocks it got
+    }
+    int good = verify_blocks(fs, first_block, data, count);
+    if (good < count) {
+        printf("Error: data block %d is corrupted.\n", first_block + good);
+    }
+    long long done = got == end - start && good == count ? length : start + (long long) good * block_size - offset;
+    done = done < 0 ? 0 : done < length ? done : length;
+    if (data != buffer) {
+        memcpy(buffer, data + (offset - start), done);
+    }
+    if (data != buffer && fs->map == NULL) {
+        free(data);
+    }
+    return length <= 0 ? 0 : done;
+}
+
+// journal - metadata writes of the operations in a batch are collected into one transaction, which is appended to the journal
+// region with a single write and fdatasync and only then written in place; select_fs replays what a crash left in the journal
+static int journal_enabled(FS* fs) {
+    return (fs->superblock.features & FEATURE_JOURNAL) != 0;
+}
+
+// journal region for a file system, room for a batch that rewrites all of the metadata and for the blocks defragment_fs moves -
+// the region is sparse like the rest of the disk file, so only the part that was used takes space on the host
+static long long journal_size_for(SUPERBLOCK* superblock) {
+    SUPERBLOCK layout = *superblock;
+    layout.journal_size = 0;
+    compute_layout(&layout);
+    long long metadata = layout.data_offset - layout.bitmap_offset;
+    metadata = metadata < JOURNAL_MIN_SIZE ? JOURNAL_MIN_SIZE : metadata;
+    return align_to_page(2 * metadata + 16LL * superblock->block_size);
+}
+
+// data blocks a defragmentation pass may move through the journal, half of it so the metadata of the pass fits too
+static int journal_block_budget(FS* fs) {
+    long long fit = fs->superblock.journal_size / 2 / (fs->superblock.block_size + sizeof(JOURNAL_RECORD));
+    return fit < 1 ? 1 : fit > INT_MAX ? INT_MAX : fit;
+}
+
+static long long align_to_record(long long length) {
+    return (length + 7) / 8 * 8;
+}
+
+static JOURNAL_RECORD* journal_record(JOURNAL* journal, int index) {
+    return (JOURNAL_RECORD*) (journal->buffer + journal->record_positions[index]);
+}
+
+// record of the pending transaction that writes length bytes at offset, -1 if there is none
+static int journal_find(JOURNAL* journal, long long offset, long long length) {
+    for (int i = journal->buckets[(offset / 256) & (JOURNAL_BUCKETS - 1)]; i != -1; i = journal->record_next[i]) {
+        JOURNAL_RECORD* record = journal_record(journal, i);
+        if (record->offset == offset && record->length == length) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void journal_clear(JOURNAL* journal) {
+    if (journal->record_count > 0) {
+        memset(journal->buckets, -1, sizeof(int) * JOURNAL_BUCKETS);
+    }
+    journal->record_count = 0;
+    journal->used = sizeof(TRANSACTION);
+    journal->pending_operations = 0;
+    journal->blocks_freed = 0;
+}
+
+// write metadata - into the pending transaction when the image has a journal, a later write of the same record replaces the data
+static void meta_write(FS* fs, long long offset, void* data, long long length) {
+    if (!journal_enabled(fs)) {
+        disk_write(fs, offset, data, length);
+        return;
+    }
+    JOURNAL* journal = &fs->journal;
+    int index = journal_find(journal, offset, length);
+    if (index == -1) {
+        long long size = sizeof(JOURNAL_RECORD) + align_to_record(length);
+        if (journal->used + size > journal->capacity) {
+            while (journal->used + size > journal->capacity) {
+                journal->capacity *= 2;
+            }
+            journal->buffer = (char*) realloc(journal->buffer, journal->capacity);
+        }
+        if (journal->record_count == journal->record_capacity) {
+            journal->record_capacity *= 2;
+            journal->record_positions = (long long*) realloc(journal->record_positions, sizeof(long long) * journal->record_capacity);
+            journal->record_next = (int*) realloc(journal->record_next, sizeof(int) * journal->record_capacity);
+        }
+        index = journal->record_count++;
+        JOURNAL_RECORD* record = (JOURNAL_RECORD*) (journal->buffer + journal->used);
+        memset((char*) record + size - 8, 0, 8); // padding
+        record->offset = offset;
+        record->length = length;
+        record->reserved = 0;
+        journal->record_positions[index] = journal->used;
+        journal->used += size;
+        int bucket = (offset / 256) & (JOURNAL_BUCKETS - 1);
+        journal->record_next[index] = journal->buckets[bucket];
+        journal->buckets[bucket] = index;
+    }
+    memcpy((char*) journal_record(journal, index) + sizeof(JOURNAL_RECORD), data, length);
+}
+
+// read metadata written with meta_write, the pending transaction holds the newest version until it is committed
+static void meta_read(FS* fs, long long offset, void* data, long long length) {
+    int index = journal_enabled(fs) ? journal_find(&fs->journal, offset, length) : -1;
+    if (index != -1) {
+        memcpy(data, (char*) journal_record(&fs->journal, index) + sizeof(JOURNAL_RECORD), length);
+    } else {
+        disk_read(fs, offset, data, length);
+    }
+}
+
+// write the records of a transaction in place, returns -1 if a record does not fit the transaction or the disk file
+static int apply_transaction(int fd, char* transaction, long long total_size) {
+    TRANSACTION* header = (TRANSACTION*) transaction;
+    long long position = sizeof(TRANSACTION);
+    for (int i = 0; i < header->record_count; i++) {
+        JOURNAL_RECORD* record = (JOURNAL_RECORD*) (transaction + position);
+        if (position + (long long) sizeof(JOURNAL_RECORD) > header->length || record->length < 0
+            || position + (long long) sizeof(JOURNAL_RECORD) + align_to_record(record->length) > header->length
+            || record->offset < 0 || record->offset + record->length > total_size) {
+            return -1;
+        }
+        pwrite_all(fd, (char*) record + sizeof(JOURNAL_RECORD), record->length, record->offset);
+        position += sizeof(JOURNAL_RECORD) + align_to_record(record->length);
+    }
+    return 0;
+}
+
+// empty the journal, the next transaction gets sequence and goes right after the header
+static void journal_reset(int fd, SUPERBLOCK* superblock, unsigned int sequence) {
+    JOURNAL_HEADER header;
+    memset(&header, 0, sizeof(JOURNAL_HEADER));
+    header.magic_number = JOURNAL_MAGIC_NUMBER;
+    header.sequence = sequence;
+    pwrite_all(fd, &header, sizeof(JOURNAL_HEADER), superblock->journal_offset);
+    fdatasync(fd);
+    count_stat(&stats.sync_calls, 1);
+}
+
+// once everything committed so far is in place, the transactions in the journal are not needed any more
+static void journal_checkpoint(FS* fs) {
+    fdatasync(fs->fd);
+    count_stat(&stats.sync_calls, 1);
+    journal_reset(fs->fd, &fs->superblock, fs->journal.sequence);
+    fs->journal.head = PAGE_SIZE;
+    fs->journal.base = fs->journal.sequence;
+}
+
+// give the space of the blocks freed by committed operations back to the host file system, a run of adjacent blocks with one
+// call - until the commit the old metadata may still point at them, and a block allocated again since keeps its data
+static void punch_freed_blocks(FS* fs) {
+    qsort(fs->punch_blocks, fs->punch_count, sizeof(int), compare_ints);
+    for (int i = 0; i < fs->punch_count;) {
+        int start = fs->punch_blocks[i];
+        int end = start;
+        for (; i < fs->punch_count && fs->punch_blocks[i] <= end; i++) {
+            int block_index = fs->punch_blocks[i];
+            if (block_index == end && !(fs->free_map[block_index / 64] >> (block_index % 64) & 1)) {
+                end++;
+            }
+        }
+        if (end > start) {
+            fallocate(fs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block_offset(fs, start), (long long) (end - start) * fs->superblock.block_size);
+            count_stat(&stats.punch_calls, 1);
+        }
+    }
+    fs->punch_count = 0;
+}
+
+// shrink a transaction too large for the journal - records of data blocks that were free at the last commit, such as new directory
+// and extent blocks, are written in place and synced first, no committed metadata points at them so a crash before the commit
+// leaves them unused, and only the records of blocks in use stay in the transaction
+static void journal_write_new_blocks(FS* fs) {
+    JOURNAL* journal = &fs->journal;
+    int block_size = fs->superblock.block_size;
+    // the bitmap in place is the one of the last commit, every commit is applied right after it is logged
+    unsigned long long* committed = (unsigned long long*) malloc(sizeof(unsigned long long) * fs->map_words);
+    pread_all(fs->fd, committed, sizeof(unsigned long long) * fs->map_words, fs->superblock.bitmap_offset);
+    long long position = sizeof(TRANSACTION);
+    long long kept = sizeof(TRANSACTION);
+    int kept_count = 0;
+    for (int i = 0; i < journal->record_count; i++) {
+        JOURNAL_RECORD* record = (JOURNAL_RECORD*) (journal->buffer + position);
+        long long size = sizeof(JOURNAL_RECORD) + align_to_record(record->length);
+        long long data_position = record->offset - fs->superblock.data_offset;
+        int block_index = data_position / block_size;
+        if (data_position >= 0 && data_position % block_size == 0 && record->length == block_size
+            && !(committed[block_index / 64] >> (block_index % 64) & 1)) {
+            pwrite_all(fs->fd, (char*) record + sizeof(JOURNAL_RECORD), record->length, record->offset);
+        } else {
+            memmove(journal->buffer + kept, record, size);
+            kept += size;
+            kept_count++;
+        }
+        position += size;
+    }
+    fdatasync(fs->fd);
+    count_stat(&stats.sync_calls, 1);
+    journal->record_count = kept_count;
+    journal->used = kept;
+    free(committed);
+}
+
+// append the pending transaction to the journal, the fdatasync after it is the commit point of every operation in the batch
+static void journal_commit(FS* fs) {
+    JOURNAL* journal = &fs->journal;
+    if (journal->record_count == 0) {
+        journal_clear(journal);
+        return;
+    }
+    int blocks_freed = journal->blocks_freed;
+    if (journal->used > fs->superblock.journal_size - PAGE_SIZE) {
+        journal_write_new_blocks(fs);
+    }
+    TRANSACTION* transaction = (TRANSACTION*) journal->buffer;
+    memset(transaction, 0, sizeof(TRANSACTION));
+    transaction->magic_number = TRANSACTION_MAGIC_NUMBER;
+    transaction->sequence = journal->sequence;
+    transaction->record_count = journal->record_count;
+    transaction->length = journal->used;
+    transaction->checksum = crc32c(0, journal->buffer, journal->used);
+    count_stat(&stats.journal_commits, 1);
+    count_stat(&stats.journal_bytes, journal->used);
+    if (journal->used > fs->superblock.journal_size - journal->head) {
+        journal_checkpoint(fs);
+    }
+    if (journal->used <= fs->superblock.journal_size - journal->head) {
+        pwrite_all(fs->fd, journal->buffer, journal->used, fs->superblock.journal_offset + journal->head);
+        fdatasync(fs->fd);
+        count_stat(&stats.sync_calls, 1);
+        journal->head += journal->used;
+        journal->sequence++;
+        apply_transaction(fs->fd, journal->buffer, fs->superblock.total_size);
+    } else {
+        // only a disk created with a smaller journal gets here
+        printf("Error: the changes do not fit the journal, they are written in place and a crash now may damage the file system.\n");
+        apply_transaction(fs->fd, journal->buffer, fs->superblock.total_size);
+        fdatasync(fs->fd);
+        count_stat(&stats.sync_calls, 1);
+    }
+    journal_clear(journal);
+    if (blocks_freed) {
+        // older records for the freed blocks must not be replayed over whatever is written to them next
+        journal_checkpoint(fs);
+    }
+    punch_freed_blocks(fs);
+}
+
+// apply the transactions committed after the last checkpoint in order, up to the first one that is missing or damaged,
+// returns the sequence of the next transaction
+static unsigned int journal_replay(int fd, SUPERBLOCK* superblock) {
+    JOURNAL_HEADER header;
+    memset(&header, 0, sizeof(JOURNAL_HEADER));
+    pread_all(fd, &header, sizeof(JOURNAL_HEADER), superblock->journal_offset);
+    unsigned int sequence = header.magic_number == JOURNAL_MAGIC_NUMBER ? header.sequence : 0;
+    long long head = PAGE_SIZE;
+    int replayed = 0;
+    char* buffer = NULL;
+    while (head + (long long) sizeof(TRANSACTION) <= superblock->journal_size) {
+        TRANSACTION transaction;
+        pread_all(fd, &transaction, sizeof(TRANSACTION), superblock->journal_offset + head);
+        if (transaction.magic_number != TRANSACTION_MAGIC_NUMBER || transaction.sequence != sequence || transaction.length < (long long) sizeof(TRANSACTION)
+            || transaction.length > superblock->journal_size - head || transaction.length % 8 != 0) {
+            break;
+        }
+        buffer = (char*) realloc(buffer, transaction.length);
+        if (pread_all(fd, buffer, transaction.length, superblock->journal_offset + head) != transaction.length) {
+            break;
+        }
+        ((TRANSACTION*) buffer)->checksum = 0;
+        if (crc32c(0, buffer, transaction.length) != transaction.checksum || apply_transaction(fd, buffer, superblock->total_size) == -1) {
+            break;
+        }
+        sequence++;
+        head += transaction.length;
+        replayed++;
+    }
+    free(buffer);
+    if (replayed > 0 || header.magic_number != JOURNAL_MAGIC_NUMBER) {
+        journal_reset(fd, superblock, sequence); // syncs the replayed records before the journal forgets them
+    }
+    return sequence;
+}
+
+// write count adjacent data blocks with a single call
+static void write_blocks(FS* fs, int start, int count, char* data) {
+    disk_write(fs, block_offset(fs, start), data, (long long) fs->superblock.block_size * count);
+}
+
+// block cache - with the file backend get and read_file_at read data blocks through a fixed number of slots evicted in least
+// recently used order, a miss that continues the previous read also reads ahead, twice as far each time up to READAHEAD_SIZE;
+// freed blocks leave the cache and the whole cache is dropped when another process changed the file system
+static void cache_clear(FS* fs) {
+    BLOCK_CACHE* cache = &fs->cache;
+    memset(cache->buckets, -1, sizeof(int) * (cache->bucket_mask + 1));
+    for (int i = 0; i < cache->slot_count; i++) {
+        cache->slot_block[i] = -1;
+        cache->older[i] = i - 1;
+        cache->newer[i] = i + 1 < cache->slot_count ? i + 1 : -1;
+    }
+    cache->oldest = cache->slot_count > 0 ? 0 : -1;
+    cache->newest = cache->slot_count - 1;
+    cache->next_block = -1;
+    cache->window = 0;
+}
+
+// a cache of megabytes MiB, none with the mmap backend
+static void cache_init(FS* fs, int megabytes) {
+    BLOCK_CACHE* cache = &fs->cache;
+    long long slots = fs->map != NULL || megabytes <= 0 ? 0 : ((long long) megabytes << 20) / fs->superblock.block_size;
+    cache->slot_count = slots < fs->superblock.total_data_blocks ? slots : fs->superblock.total_data_blocks;
+    cache->data = (char*) malloc((long long) cache->slot_count * fs->superblock.block_size);
+    cache->slot_block = (int*) malloc(sizeof(int) * cache->slot_count);
+    cache->newer = (int*) malloc(sizeof(int) * cache->slot_count);
+    cache->older = (int*) malloc(sizeof(int) * cache->slot_count);
+    int buckets = 1;
+    while (buckets < cache->slot_count) {
+        buckets *= 2;
+    }
+    cache->buckets = (int*) malloc(sizeof(int) * buckets);
+    cache->bucket_next = (int*) malloc(sizeof(int) * cache->slot_count);
+    cache->bucket_mask = buckets - 1;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->read_ahead = 0;
+    cache_clear(fs);
+}
+
+static void cache_free(FS* fs) {
+    BLOCK_CACHE* cache = &fs->cache;
+    free(cache->data);
+    free(cache->slot_block);
+    free(cache->newer);
+    free(cache->older);
+    free(cache->buckets);
+    free(cache->bucket_next);
+}
+
+// the functions below up to cache_read expect the caller to hold cache->lock
+static int cache_find(BLOCK_CACHE* cache, int block_index) {
+    for (int slot = cache->buckets[block_index & cache->bucket_mask]; slot != -1; slot = cache->bucket_next[slot]) {
+        if (cache->slot_block[slot] == block_index) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// make slot the most recently used one, or the next one to be reused
+static void cache_move(BLOCK_CACHE* cache, int slot, int newest) {
+    if (cache->older[slot] != -1) {
+        cache->newer[cache->older[slot]] = cache->newer[slot];
+    } else {
+        cache->oldest = cache->newer[slot];
+    }
+    if (cache->newer[slot] != -1) {
+        cache->older[cache->newer[slot]] = cache->older[slot];
+    } else {
+        cache->newest = cache->older[slot];
+    }
+    if (newest) {
+        cache->older[slot] = cache->newest;
+        cache->newer[slot] = -1;
+        if (cache->newest != -1) {
+            cache->newer[cache->newest] = slot;
+        } else {
+            cache->oldest = slot;
+        }
+        cache->newest = slot;
+    } else {
+        cache->newer[slot] = cache->oldest;
+        cache->older[slot] = -1;
+        if (cache->oldest != -1) {
+            cache->older[cache->oldest] = slot;
+        } else {
+            cache->newest = slot;
+        }
+        cache->oldest = slot;
+    }
+}
+
+static void cache_unhash(BLOCK_CACHE* cache, int slot) {
+    int* link = &cache->buckets[cache->slot_block[slot] & cache->bucket_mask];
+    while (*link != slot) {
+        link = &cache->bucket_next[*link];
+    }
+    *link = cache->bucket_next[slot];
+    cache->slot_block[slot] = -1;
+}
+
+// copy a data block into the least recently used slot
+static void cache_insert(FS* fs, int block_index, char* data) {
+    BLOCK_CACHE* cache = &fs->cache;
+    if (cache_find(cache, block_index) != -1) {
+        return;
+    }
+    int slot = cache->oldest;
+    if (cache->slot_block[slot] != -1) {
+        cache_unhash(cache, slot);
+    }
+    cache->slot_block[slot] = block_index;
+    cache->bucket_next[slot] = cache->buckets[block_index & cache->bucket_mask];
+    cache->buckets[block_index & cache->bucket_mask] = slot;
+    memcpy(cache->data + (long long) slot * fs->superblock.block_size, data, fs->superblock.block_size);
+    cache_move(cache, slot, 1);
+}
+
+// a freed block may get other data
+static void cache_drop(FS* fs, int block_index) {
+    BLOCK_CACHE* cache = &fs->cache;
+    if (cache->slot_count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    int slot = cache_find(cache, block_index);
+    if (slot != -1) {
+        cache_unhash(cache, slot);
+        cache_move(cache, slot, 0);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// read length bytes at offset in the data area through the cache, readahead stops before block end_block - returns the bytes read
+static long long cache_read(FS* fs, long long offset, char* buffer, long long length, int end_block) {
+    BLOCK_CACHE* cache = &fs->cache;
+    if (cache->slot_count == 0) {
+        return checked_read(fs, offset, buffer, length);
+    }
+    int block_size = fs->superblock.block_size;
+    int max_window = READAHEAD_SIZE / block_size > 1 ? READAHEAD_SIZE / block_size : 1;
+    int max_run = cache->slot_count / 2 > 1 ? cache->slot_count / 2 : 1; // a run read from the disk file never evicts itself
+    char* run = NULL;
+    long long done = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (done < length) {
+        long long position = offset + done - fs->superblock.data_offset;
+        int block_index = position / block_size;
+        int offset_in_block = position % block_size;
+        int last_block = (position + length - done - 1) / block_size;
+        int slot = cache_find(cache, block_index);
+        if (slot != -1) {
+            long long count = block_size - offset_in_block < length - done ? block_size - offset_in_block : length - done;
+            memcpy(buffer + done, cache->data + (long long) slot * block_size + offset_in_block, count);
+            cache_move(cache, slot, 1);
+            cache->hits++;
+            cache->next_block = block_index + 1;
+            done += count;
+            continue;
+        }
+        cache->misses++;
+        // the blocks missing from here on, and when they reach the end of a sequential read the window after them
+        int count = 1;
+        while (block_index + count <= last_block && count < max_run && cache_find(cache, block_index + count) == -1) {
+            count++;
+        }
+        int ahead = 0;
+        if (block_index + count > last_block) {
+            if (block_index == cache->next_block) {
+                cache->window = cache->window == 0 ? 1 : cache->window * 2 < max_window ? cache->window * 2 : max_window;
+            } else {
+                cache->window = 0;
+            }
+            ahead = end_block - (block_index + count) < cache->window ? end_block - (block_index + count) : cache->window;
+            ahead = ahead < max_run - count ? ahead : max_run - count;
+            ahead = ahead > 0 ? ahead : 0;
+            cache->read_ahead += ahead;
+        }
+        cache->next_block = block_index + count;
+        pthread_mutex_unlock(&cache->lock);
+        long long bytes = (long long) (count + ahead) * block_size;
+        run = (char*) realloc(run, bytes);
+        long long got = pread_all(fs->fd, run, bytes, block_offset(fs, block_index));
+        int good = got == bytes ? verify_blocks(fs, block_index, run, count + ahead) : 0;
+        pthread_mutex_lock(&cache->lock);
+        if (got != bytes) {
+            break;
+        }
+        for (int i = 0; i < good; i++) {
+            cache_insert(fs, block_index + i, run + (long long) i * block_size);
+        }
+        long long used = (long long) count * block_size - offset_in_block < length - done ? (long long) count * block_size - offset_in_block : length - done;
+        if (good < count) {
+            // a damaged block read ahead is only left out of the cache, one that was asked for ends the read
+            used = (long long) good * block_size - offset_in_block < used ? (long long) good * block_size - offset_in_block : used;
+            used = used > 0 ? used : 0;
+            memcpy(buffer + done, run + offset_in_block, used);
+            done += used;
+            printf("Error: data block %d is corrupted.\n", block_index + good);
+            break;
+        }
+        memcpy(buffer + done, run + offset_in_block, used);
+        done += used;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(run);
+    return done;
+}
+
+// data transfers - the data of a copy is split into transfers of up to TRANSFER_SIZE bytes that worker threads run in parallel
+// with positioned reads and writes, the metadata is only changed by the calling thread before and after them
+typedef struct transfer {
+    char* path; // file outside the file system, each transfer opens it on its own
+    long long file_offset;
+    long long disk_offset;
+    long long length;
+    int to_disk;
+    int owner; // tag of the caller, to find out which file failed
+    int failed;
+    int unreadable; // the data blocks could not be read or did not match their checksums, as opposed to the file outside
+    int stored_raw; // compression would not have made the file smaller, its data went in as it is
+    int cached; // read through the block cache, files larger than half of it go around it so they do not flush it
+    int codec; // compressed files are one transfer of the whole file, see compress_transfer
+    int inode;
+    long long stored; // bytes of data blocks the compressed file took
+    unsigned int* checksums; // of the blocks written, in the order of the data, see sum_transfer
+    int checksum_count;
+} TRANSFER;
+
+typedef struct transfer_queue {
+    FS* fs;
+    TRANSFER* transfers;
+    int count;
+    int capacity;
+    int next; // next transfer to run, taken by the workers with an atomic increment
+    int shared; // more than one thread writes to the disk file
+} TRANSFER_QUEUE;
+
+static void queue_init(TRANSFER_QUEUE* queue, FS* fs) {
+    memset(queue, 0, sizeof(TRANSFER_QUEUE));
+    queue->fs = fs;
+}
+
+static void queue_free(TRANSFER_QUEUE* queue) {
+    for (int i = 0; i < queue->count; i++) {
+        free(queue->transfers[i].path);
+        free(queue->transfers[i].checksums);
+    }
+    free(queue->transfers);
+}
+
+static TRANSFER* queue_add(TRANSFER_QUEUE* queue, char* path, long long length, int to_disk, int owner) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        queue->transfers = (TRANSFER*) realloc(queue->transfers, sizeof(TRANSFER) * queue->capacity);
+    }
+    TRANSFER* transfer = &queue->transfers[queue->count++];
+    memset(transfer, 0, sizeof(TRANSFER));
+    transfer->path = strdup(path);
+    transfer->length = length;
+    transfer->to_disk = to_disk;
+    transfer->owner = owner;
+    transfer->inode = -1;
+    return transfer;
+}
+
+// queue the transfers of size bytes between the file at path and the data blocks of inode_index, split at extent and TRANSFER_SIZE boundaries
+static void queue_file(TRANSFER_QUEUE* queue, int inode_index, char* path, long long size, int to_disk, int owner) {
+    FS* fs = queue->fs;
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    long long cache_bytes = (long long) fs->cache.slot_count * fs->superblock.block_size;
+    if (fs->inodes[inode_index].codec != CODEC_NONE && size > 0) {
+        // where a frame goes depends on the size of the frames before it
+        TRANSFER* transfer = queue_add(queue, path, size, to_disk, owner);
+        transfer->codec = fs->inodes[inode_index].codec;
+        transfer->inode = inode_index;
+        transfer->cached = !to_disk && fs->inodes[inode_index].stored_size <= cache_bytes / 2;
+        return;
+    }
+    long long position = 0;
+    for (int i = 0; i < list->count && position < size; i++) {
+        long long extent_end = position + (long long) list->extents[i].length * fs->superblock.block_size;
+        long long disk_offset = block_offset(fs, list->extents[i].start);
+        while (position < size && position < extent_end) {
+            long long length = extent_end - position < TRANSFER_SIZE ? extent_end - position : TRANSFER_SIZE;
+            length = size - position < length ? size - position : length;
+            TRANSFER* transfer = queue_add(queue, path, length, to_disk, owner);
+            transfer->file_offset = position;
+            transfer->disk_offset = disk_offset;
+            transfer->cached = !to_disk && size <= cache_bytes / 2;
+            position += length;
+            disk_offset += length;
+        }
+    }
+}
+
+// copy a transfer out of the file system IO_SIZE bytes at a time through the buffer of the thread, through the block cache or
+// straight from the disk file - the checksums of the blocks are checked either way
+static long long checked_transfer(FS* fs, TRANSFER* transfer, int fd, char** buffer) {
+    int block_size = fs->superblock.block_size;
+    int end_block = (transfer->disk_offset + transfer->length - fs->superblock.data_offset + block_size - 1) / block_size;
+    if (*buffer == NULL) {
+        *buffer = (char*) malloc(IO_SIZE);
+    }
+    long long done = 0;
+    while (done < transfer->length) {
+        long long count = transfer->length - done < IO_SIZE ? transfer->length - done : IO_SIZE;
+        long long got = transfer->cached ? cache_read(fs, transfer->disk_offset + done, *buffer, count, end_block) : checked_read(fs, transfer->disk_offset + done, *buffer, count);
+        if (got != count) {
+            transfer->unreadable = 1;
+            break;
+        }
+        if (pwrite_all(fd, *buffer, count, transfer->file_offset + done) != count) {
+            break;
+        }
+        done += count;
+    }
+    return done;
+}
+
+// compressed files - the data blocks of the file hold a table of frame_count + 1 offsets followed by the frames, each one
+// COMPRESS_CHUNK bytes of the file compressed on its own so a read only decodes the frames it needs - the offsets are positions
+// in the data blocks of the file and the last one is the end of the last frame, a frame that would not get smaller is stored as it is
+static long long frame_table_size(long long size) {
+    return ((size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK + 1) * (long long) sizeof(long long);
+}
+
+// bytes of data blocks the data of an inode takes
+static long long stored_bytes(INODE* inode) {
+    return inode->codec == CODEC_NONE ? inode->size : inode->stored_size;
+}
+
+// position in the data blocks of a file, counted over its extents in order
+typedef struct stream {
+    FS* fs;
+    EXTENT_LIST* list;
+    int extent;
+    long long offset; // bytes into the extent
+    long long position;
+    int cached; // read through the block cache
+} STREAM;
+
+static void stream_init(STREAM* stream, FS* fs, int inode_index, int cached) {
+    memset(stream, 0, sizeof(STREAM));
+    stream->fs = fs;
+    stream->list = &fs->extents[inode_index];
+    stream->cached = cached;
+}
+
+static void stream_seek(STREAM* stream, long long position) {
+    if (position < stream->position) {
+        stream->extent = 0;
+        stream->offset = 0;
+        stream->position = 0;
+    }
+    stream->offset += position - stream->position;
+    stream->position = position;
+    while (stream->extent < stream->list->count && stream->offset >= (long long) stream->list->extents[stream->extent].length * stream->fs->superblock.block_size) {
+        stream->offset -= (long long) stream->list->extents[stream->extent].length * stream->fs->superblock.block_size;
+        stream->extent++;
+    }
+}
+
+// read or write length bytes at the position of the stream and move past them, returns the bytes moved
+static long long stream_io(STREAM* stream, void* buffer, long long length, int write) {
+    FS* fs = stream->fs;
+    long long done = 0;
+    while (done < length && stream->extent < stream->list->count) {
+        EXTENT* extent = &stream->list->extents[stream->extent];
+        long long count = (long long) extent->length * fs->superblock.block_size - stream->offset;
+        count = count < length - done ? count : length - done;
+        long long offset = block_offset(fs, extent->start) + stream->offset;
+        if (write) {
+            disk_write(fs, offset, (char*) buffer + done, count);
+        } else if (!stream->cached ? checked_read(fs, offset, (char*) buffer + done, count) != count
+                                   : cache_read(fs, offset, (char*) buffer + done, count, extent->start + extent->length) != count) {
+            break;
+        }
+        done += count;
+        stream_seek(stream, stream->position + count);
+    }
+    return done;
+}
+
+// read the frame between the stream positions start and end that holds length bytes of the file and decode it into raw,
+// packed takes the compressed frame - returns -1 if the frame is damaged
+static int read_frame(STREAM* stream, long long start, long long end, int length, char* raw, char* packed) {
+    long long stored = end - start;
+    if (stored <= 0 || stored > length) {
+        return -1;
+    }
+    stream_seek(stream, start);
+    if (stream_io(stream, stored == length ? raw : packed, stored, 0) != stored) {
+        return -1;
+    }
+    return stored == length || decompress_block(packed, stored, raw, length) == length ? 0 : -1;
+}
+
+// copy the file of a transfer into the data blocks of its inode as it is, through the buffer of the thread
+static long long raw_transfer(TRANSFER* transfer, STREAM* stream, int fd, char* buffer) {
+    long long done = 0;
+    stream_seek(stream, 0);
+    while (done < transfer->length) {
+        long long count = transfer->length - done < IO_SIZE ? transfer->length - done : IO_SIZE;
+        if (pread_all(fd, buffer, count, done) != count || stream_io(stream, buffer, count, 1) != count) {
+            break;
+        }
+        done += count;
+    }
+    return done;
+}
+
+// compress the file of a transfer into the data blocks of its inode a frame at a time, the buffer of the thread holds a frame before
+// and after compression - the frame table goes in last - the inode only has the blocks of the raw file, once the frames and the
+// table would not be smaller than that the file is stored as it is
+static long long compress_transfer(FS* fs, TRANSFER* transfer, int fd, char** buffer) {
+    int frame_count = (transfer->length + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    long long* table = (long long*) malloc(sizeof(long long) * (frame_count + 1));
+    if (*buffer == NULL) {
+        *buffer = (char*) malloc(IO_SIZE);
+    }
+    char* raw = *buffer;
+    char* packed = *buffer + COMPRESS_CHUNK;
+    STREAM stream;
+    stream_init(&stream, fs, transfer->inode, 0);
+    long long position = frame_table_size(transfer->length);
+    long long done = 0;
+    transfer->stored_raw = position >= transfer->length;
+    for (int i = 0; i < frame_count && !transfer->stored_raw; i++) {
+        int length = transfer->length - done < COMPRESS_CHUNK ? transfer->length - done : COMPRESS_CHUNK;
+        if (pread_all(fd, raw, length, done) != length) {
+            break;
+        }
+        int stored = compress_block(transfer->codec, raw, length, packed, length - 1);
+        stored = stored > 0 ? stored : length;
+        if (position + stored >= transfer->length) {
+            transfer->stored_raw = 1;
+            break;
+        }
+        stream_seek(&stream, position);
+        if (stream_io(&stream, stored < length ? packed : raw, stored, 1) != stored) {
+            break;
+        }
+        table[i] = position;
+        position += stored;
+        done += length;
+    }
+    if (transfer->stored_raw) {
+        done = raw_transfer(transfer, &stream, fd, *buffer);
+        position = transfer->length;
+    } else {
+        table[frame_count] = position;
+        stream_seek(&stream, 0);
+        if (done == transfer->length && stream_io(&stream, table, sizeof(long long) * (frame_count + 1), 1) != (long long) sizeof(long long) * (frame_count + 1)) {
+            done = 0;
+        }
+    }
+    // the rest of the last block is zeroed, its checksum must not depend on what the block held before
+    int tail = (fs->superblock.block_size - position % fs->superblock.block_size) % fs->superblock.block_size;
+    memset(*buffer, 0, tail);
+    stream_seek(&stream, position);
+    if (done == transfer->length && stream_io(&stream, *buffer, tail, 1) != tail) {
+        done = 0;
+    }
+    transfer->stored = position;
+    free(table);
+    return done;
+}
+
+// decompress the file of a transfer out of the data blocks of its inode a frame at a time
+static long long expand_transfer(FS* fs, TRANSFER* transfer, int fd, char** buffer) {
+    int frame_count = (transfer->length + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    long long* table = (long long*) malloc(sizeof(long long) * (frame_count + 1));
+    if (*buffer == NULL) {
+        *buffer = (char*) malloc(IO_SIZE);
+    }
+    STREAM stream;
+    stream_init(&stream, fs, transfer->inode, transfer->cached);
+    long long done = 0;
+    if (stream_io(&stream, table, sizeof(long long) * (frame_count + 1), 0) != (long long) sizeof(long long) * (frame_count + 1)) {
+        transfer->unreadable = 1;
+    } else {
+        for (int i = 0; i < frame_count; i++) {
+            int length = transfer->length - done < COMPRESS_CHUNK ? transfer->length - done : COMPRESS_CHUNK;
+            if (read_frame(&stream, table[i], table[i + 1], length, *buffer, *buffer + COMPRESS_CHUNK) == -1) {
+                transfer->unreadable = 1;
+                break;
+            }
+            if (pwrite_all(fd, *buffer, length, done) != length) {
+                break;
+            }
+            done += length;
+        }
+    }
+    free(table);
+    return done;
+}
+
+// checksums of the blocks a transfer wrote, read back once the data is in place so the fast copy paths stay as they are -
+// the blocks of a compressed file are summed in the order of its data
+static void sum_transfer(FS* fs, TRANSFER* transfer, char** buffer) {
+    int block_size = fs->superblock.block_size;
+    long long bytes = transfer->codec != CODEC_NONE ? transfer->stored : transfer->length;
+    int count = (bytes + block_size - 1) / block_size;
+    transfer->checksums = (unsigned int*) malloc(sizeof(unsigned int) * (count > 0 ? count : 1));
+    if (*buffer == NULL) {
+        *buffer = (char*) malloc(IO_SIZE);
+    }
+    STREAM stream;
+    if (transfer->codec != CODEC_NONE) {
+        stream_init(&stream, fs, transfer->inode, 0);
+    }
+    int summed = 0;
+    while (summed < count) {
+        int group = count - summed < fs->io_blocks ? count - summed : fs->io_blocks;
+        long long length = (long long) group * block_size;
+        long long offset = transfer->disk_offset + (long long) summed * block_size;
+        char* data = fs->map != NULL && transfer->codec == CODEC_NONE ? fs->map + offset : *buffer;
+        if (transfer->codec != CODEC_NONE ? stream_io(&stream, data, length, 0) != length
+                                          : fs->map == NULL && pread_all(fs->fd, data, length, offset) != length) {
+            break; // the blocks left keep no checksum
+        }
+        checksum_blocks(fs, data, group, transfer->checksums + summed);
+        summed += group;
+    }
+    transfer->checksum_count = summed;
+}
+
+static int run_transfer(TRANSFER_QUEUE* queue, TRANSFER* transfer, char** buffer) {
+    FS* fs = queue->fs;
+    int fd = open(transfer->path, transfer->to_disk ? O_RDONLY : O_WRONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    long long done;
+    if (transfer->codec != CODEC_NONE) {
+        done = transfer->to_disk ? compress_transfer(fs, transfer, fd, buffer) : expand_transfer(fs, transfer, fd, buffer);
+    } else if (transfer->to_disk) {
+        done = fs->map != NULL ? pread_all(fd, fs->map + transfer->disk_offset, transfer->length, transfer->file_offset)
+                               : copy_range(fd, transfer->file_offset, fs->fd, transfer->disk_offset, transfer->length, queue->shared);
+    } else if (fs->map != NULL) {
+        int first_block = (transfer->disk_offset - fs->superblock.data_offset) / fs->superblock.block_size;
+        int count = (transfer->length + fs->superblock.block_size - 1) / fs->superblock.block_size;
+        int good = verify_blocks(fs, first_block, fs->map + transfer->disk_offset, count);
+        if (good < count) {
+            printf("Error: data block %d is corrupted.\n", first_block + good);
+            transfer->unreadable = 1;
+        }
+        done = good == count ? pwrite_all(fd, fs->map + transfer->disk_offset, transfer->length, transfer->file_offset) : 0;
+    } else {
+        done = checked_transfer(fs, transfer, fd, buffer);
+    }
+    close(fd);
+    if (done == transfer->length && transfer->to_disk) {
+        sum_transfer(fs, transfer, buffer);
+    }
+    return done == transfer->length ? 0 : -1;
+}
+
+static void* transfer_worker(void* argument) {
+    TRANSFER_QUEUE* queue = (TRANSFER_QUEUE*) argument;
+    char* buffer = NULL; // allocated by the first transfer that needs it
+    for (int i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED); i < queue->count; i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) {
+        queue->transfers[i].failed = run_transfer(queue, &queue->transfers[i], &buffer) == -1;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// run the queued transfers on up to fs->threads threads including the calling one, returns -1 if any of them failed
+static int run_transfers(TRANSFER_QUEUE* queue) {
+    int threads = queue->fs->threads < queue->count ? queue->fs->threads : queue->count;
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+    queue->next = 0;
+    queue->shared = threads > 1;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, transfer_worker, queue) == 0) {
+        started++;
+    }
+    transfer_worker(queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->transfers[i].failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// deduplication index - data blocks of copied files with the CRC32C of their data, a block with the same checksum is only shared
+// once its data compares equal - the index only exists while dedup is on
+static unsigned int block_checksum(FS* fs, char* data) {
+    unsigned int checksum;
+    checksum_blocks(fs, data, 1, &checksum);
+    return checksum;
+}
+
+static void dedup_add(FS* fs, int block_index) {
+    if (fs->dedup_buckets == NULL) {
+        return;
+    }
+    unsigned int bucket = fs->blocks[block_index].checksum & fs->dedup_mask;
+    fs->dedup_next[block_index] = fs->dedup_buckets[bucket];
+    fs->dedup_buckets[bucket] = block_index;
+}
+
+static void dedup_remove(FS* fs, int block_index) {
+    if (fs->dedup_buckets == NULL) {
+        return;
+    }
+    int* link = &fs->dedup_buckets[fs->blocks[block_index].checksum & fs->dedup_mask];
+    while (*link != -1 && *link != block_index) {
+        link = &fs->dedup_next[*link];
+    }
+    if (*link == block_index) {
+        *link = fs->dedup_next[block_index];
+    }
+}
+
+static void build_dedup_index(FS* fs) {
+    if (fs->dedup_buckets == NULL) {
+        int buckets = 1;
+        while (buckets < fs->superblock.total_data_blocks) {
+            buckets *= 2;
+        }
+        fs->dedup_buckets = (int*) malloc(sizeof(int) * buckets);
+        fs->dedup_next = (int*) malloc(sizeof(int) * fs->superblock.total_data_blocks);
+        fs->dedup_mask = buckets - 1;
+    }
+    memset(fs->dedup_buckets, -1, sizeof(int) * (fs->dedup_mask + 1));
+    for (int i = fs->superblock.total_data_blocks - 1; i >= 0; i--) {
+        if (fs->blocks[i].checksum != 0 && (fs->free_map[i / 64] >> (i % 64) & 1)) {
+            dedup_add(fs, i);
+        }
+    }
+}
+
+// stored block holding the same block_size bytes as data, scratch receives the candidates - returns -1 if there is none
+static int dedup_find(FS* fs, unsigned int checksum, char* data, char* scratch) {
+    for (int i = fs->dedup_buckets[checksum & fs->dedup_mask]; i != -1; i = fs->dedup_next[i]) {
+        if (fs->blocks[i].checksum == checksum && fs->blocks[i].extra_refs < INT_MAX) {
+            meta_read(fs, block_offset(fs, i), scratch, fs->superblock.block_size); // a block moved by defrag may still be in the journal
+            if (memcmp(scratch, data, fs->superblock.block_size) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// free-block bitmap - bit i of the map is set when data block i is used, the bits past the last block are kept set in memory
+static void build_free_map(FS* fs) {
+    int total_blocks = fs->superblock.total_data_blocks;
+    if (total_blocks % 64 != 0) {
+        fs->free_map[fs->map_words - 1] &= ~(~0ULL << (total_blocks % 64));
+    }
+    fs->free_blocks = total_blocks;
+    for (int i = 0; i < fs->map_words; i++) {
+        fs->free_blocks -= __builtin_popcountll(fs->free_map[i]);
+    }
+    if (total_blocks % 64 != 0) {
+        fs->free_map[fs->map_words - 1] |= ~0ULL << (total_blocks % 64);
+    }
+}
+
+static int block_is_used(FS* fs, int block_index) {
+    return (fs->free_map[block_index / 64] >> (block_index % 64)) & 1;
+}
+
+static void set_block_used(FS* fs, int block_index) {
+    fs->free_map[block_index / 64] |= 1ULL << (block_index % 64);
+    fs->free_blocks--;
+    fs->blocks[block_index].next_block = END_OF_FILE;
+    mark_block_dirty(fs, block_index);
+    count_stat(&stats.blocks_allocated, 1);
+}
+
+static void set_block_free(FS* fs, int block_index) {
+    fs->free_map[block_index / 64] &= ~(1ULL << (block_index % 64));
+    fs->free_blocks++;
+    fs->journal.blocks_freed = 1;
+    count_stat(&stats.blocks_freed, 1);
+    if (fs->blocks[block_index].checksum != 0) {
+        dedup_remove(fs, block_index);
+    }
+    fs->blocks[block_index].extra_refs = 0;
+    fs->blocks[block_index].checksum = 0;
+    mark_block_dirty(fs, block_index);
+    cache_drop(fs, block_index);
+    if (fs->punch_count == fs->punch_capacity) {
+        fs->punch_capacity = fs->punch_capacity == 0 ? 256 : fs->punch_capacity * 2;
+        fs->punch_blocks = (int*) realloc(fs->punch_blocks, sizeof(int) * fs->punch_capacity);
+    }
+    fs->punch_blocks[fs->punch_count++] = block_index;
+}
+
+// drop one reference to a data block, the block is freed with the last one
+static void release_block(FS* fs, int block_index) {
+    if (fs->blocks[block_index].extra_refs == 0) {
+        set_block_free(fs, block_index);
+        return;
+    }
+    fs->blocks[block_index].extra_refs--;
+    fs->superblock.used_user_space += fs->superblock.block_size; // one copy of the data less is saved
+    mark_block_dirty(fs, block_index);
+    mark_superblock_dirty(fs);
+}
+
+// index of the first block at or after start whose bit equals used, or total_data_blocks if there is none
+static int find_block(FS* fs, int start, int used) {
+    if (start >= fs->superblock.total_data_blocks) {
+        return fs->superblock.total_data_blocks;
+    }
+    unsigned long long skip = used ? 0 : ~0ULL; // words that cannot contain a match
+    int word = start / 64;
+    unsigned long long bits = fs->free_map[word] ^ skip;
+    bits &= ~0ULL << (start % 64); // ignore blocks before start
+    while (bits == 0) {
+        word++;
+#ifdef __AVX2__
+        // skip four words at a time while none of them can contain a match
+        __m256i pattern = _mm256_set1_epi64x((long long) skip);
+        while (word + 4 <= fs->map_words) {
+            __m256i words = _mm256_loadu_si256((__m256i*) &fs->free_map[word]);
+            if (!_mm256_testz_si256(_mm256_xor_si256(words, pattern), _mm256_set1_epi64x(-1))) {
+                break;
+            }
+            word += 4;
+        }
+#endif
+        if (word >= fs->map_words) {
+            count_stat(&stats.blocks_scanned, (long long) (word - start / 64) * 64);
+            return fs->superblock.total_data_blocks;
+        }
+        bits = fs->free_map[word] ^ skip;
+    }
+    count_stat(&stats.blocks_scanned, (long long) (word - start / 64 + 1) * 64);
+    int block_index = word * 64 + __builtin_ctzll(bits);
+    return block_index < fs->superblock.total_data_blocks ? block_index : fs->superblock.total_data_blocks;
+}
+
+static int find_free_block(FS* fs, int start) {
+    int block_index = find_block(fs, start, 0);
+    if (block_index == fs->superblock.total_data_blocks && start > 0) {
+        block_index = find_block(fs, 0, 0); // wrap around
+    }
+    return block_index < fs->superblock.total_data_blocks ? block_index : -1;
+}
+
+// first run of at least length free blocks starting at or after start, -1 if there is none
+static int find_free_run(FS* fs, int start, int length) {
+    int run_start = find_block(fs, start, 0);
+    while (run_start < fs->superblock.total_data_blocks) {
+        int run_end = find_block(fs, run_start, 1);
+        if (run_end - run_start >= length) {
+            return run_start;
+        }
+        run_start = find_block(fs, run_end, 0);
+    }
+    return -1;
+}
+
+// extent lists - runs of adjacent blocks are merged into one extent
+static void extent_list_append(EXTENT_LIST* list, int start, int length) {
+    if (list->count > 0) {
+        EXTENT* last = &list->extents[list->count - 1];
+        if (last->start + last->length == start) {
+            last->length += length;
+            return;
+        }
+    }
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        list->extents = (EXTENT*) realloc(list->extents, sizeof(EXTENT) * list->capacity);
+        list->first_logical = (int*) realloc(list->first_logical, sizeof(int) * list->capacity);
+    }
+    int first_logical = 0;
+    if (list->count > 0) {
+        first_logical = list->first_logical[list->count - 1] + list->extents[list->count - 1].length;
+    }
+    list->extents[list->count].start = start;
+    list->extents[list->count].length = length;
+    list->first_logical[list->count] = first_logical;
+    list->count++;
+}
+
+// index of the extent holding the given block of the file
+static int extent_list_find(EXTENT_LIST* list, int logical_block) {
+    int low = 0;
+    int high = list->count - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (list->first_logical[middle] <= logical_block) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// allocate blocks for a file, as one contiguous run if possible, otherwise filling free runs in disk order
+static void allocate_extents(FS* fs, int blocks_needed, EXTENT_LIST* list) {
+    int run_start = find_free_run(fs, 0, blocks_needed);
+    if (run_start == -1) {
+        run_start = find_block(fs, 0, 0);
+    }
+    while (blocks_needed > 0) {
+        int run_end = find_block(fs, run_start, 1);
+        int length = run_end - run_start < blocks_needed ? run_end - run_start : blocks_needed;
+        for (int i = run_start; i < run_start + length; i++) {
+            set_block_used(fs, i);
+        }
+        extent_list_append(list, run_start, length);
+        blocks_needed -= length;
+        run_start = find_block(fs, run_end, 0);
+    }
+}
+
+static void release_extents(FS* fs, EXTENT_LIST* list) {
+    for (int i = 0; i < list->count; i++) {
+        for (int j = list->extents[i].start; j < list->extents[i].start + list->extents[i].length; j++) {
+            release_block(fs, j);
+        }
+    }
+    list->count = 0;
+}
+
+static void release_extent_blocks(FS* fs, INODE* inode) {
+    int block_index = inode->extent_count > INODE_EXTENTS ? inode->extent_block : END_OF_FILE;
+    while (block_index != END_OF_FILE) {
+        int next_block = fs->blocks[block_index].next_block;
+        set_block_free(fs, block_index);
+        block_index = next_block;
+    }
+    inode->extent_block = END_OF_FILE;
+}
+
+// extent blocks an inode with extent_count extents needs
+static long long extent_blocks_for(FS* fs, long long extent_count) {
+    long long extra_extents = extent_count > INODE_EXTENTS ? extent_count - INODE_EXTENTS : 0;
+    return (extra_extents + EXTENTS_PER_BLOCK(fs) - 1) / EXTENTS_PER_BLOCK(fs);
+}
+
+// store the extent list of an inode, the first INODE_EXTENTS in the inode and the rest in a chain of extent blocks
+static int store_extents(FS* fs, int inode_index) {
+    INODE* inode = &fs->inodes[inode_index];
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    release_extent_blocks(fs, inode);
+    int extra_extents = list->count > INODE_EXTENTS ? list->count - INODE_EXTENTS : 0;
+    int blocks_needed = extent_blocks_for(fs, list->count);
+    if (blocks_needed > fs->free_blocks) {
+        return -1;
+    }
+    inode->extent_count = list->count;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, list->extents, sizeof(EXTENT) * (list->count - extra_extents));
+    mark_inode_dirty(fs, inode_index);
+    char* data = (char*) malloc(fs->superblock.block_size);
+    int previous_block = END_OF_FILE;
+    for (int i = blocks_needed - 1; i >= 0; i--) {
+        // build the chain back to front so every block knows its successor
+        int block_index = find_free_block(fs, 0);
+        set_block_used(fs, block_index);
+        fs->blocks[block_index].next_block = previous_block;
+        int first = INODE_EXTENTS + i * EXTENTS_PER_BLOCK(fs);
+        int count = list->count - first < EXTENTS_PER_BLOCK(fs) ? list->count - first : EXTENTS_PER_BLOCK(fs);
+        memset(data, 0, fs->superblock.block_size);
+        memcpy(data, &list->extents[first], sizeof(EXTENT) * count);
+        meta_write(fs, block_offset(fs, block_index), data, fs->superblock.block_size);
+        previous_block = block_index;
+    }
+    free(data);
+    inode->extent_block = previous_block;
+    return 0;
+}
+
+// rebuild the extent list of an inode from the inode and its extent blocks
+static int load_extents(FS* fs, int inode_index) {
+    INODE* inode = &fs->inodes[inode_index];
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    EXTENT* extents = (EXTENT*) malloc(fs->superblock.block_size);
+    int result = 0;
+    list->count = 0;
+    int block_index = inode->extent_block;
+    for (int i = 0; i < inode->extent_count; i++) {
+        EXTENT* extent;
+        if (i < INODE_EXTENTS) {
+            extent = &inode->extents[i];
+        } else {
+            if ((i - INODE_EXTENTS) % EXTENTS_PER_BLOCK(fs) == 0) {
+                if (block_index < 0 || block_index >= fs->superblock.total_data_blocks) {
+                    result = -1;
+                    break;
+                }
+                meta_read(fs, block_offset(fs, block_index), extents, fs->superblock.block_size);
+                block_index = fs->blocks[block_index].next_block;
+            }
+            extent = &extents[(i - INODE_EXTENTS) % EXTENTS_PER_BLOCK(fs)];
+        }
+        if (extent->start < 0 || extent->length <= 0 || extent->start + extent->length > fs->superblock.total_data_blocks) {
+            result = -1;
+            break;
+        }
+        extent_list_append(list, extent->start, extent->length);
+    }
+    free(extents);
+    return result;
+}
+
+// number of data blocks covered by an extent list
+static int extent_list_blocks(EXTENT_LIST* list) {
+    if (list->count == 0) {
+        return 0;
+    }
+    return list->first_logical[list->count - 1] + list->extents[list->count - 1].length;
+}
+
+// name index - FNV-1a hash of the parent directory and the file name selects the bucket
+static unsigned int hash_name(int parent, char* name) {
+    unsigned int hash = (2166136261u ^ (unsigned int) parent) * 16777619u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static void index_link(FS* fs, int inode_index) {
+    int* bucket = &fs->name_buckets[hash_name(fs->inodes[inode_index].parent, fs->inodes[inode_index].name) & fs->bucket_mask];
+    fs->name_next[inode_index] = *bucket;
+    *bucket = inode_index;
+}
+
+static void index_add(FS* fs, int inode_index) {
+    index_link(fs, inode_index);
+    // the inode is almost always the one get_free_inode returned, on top of the stack
+    for (int i = fs->free_inode_count - 1; i >= 0; i--) {
+        if (fs->free_inodes[i] == inode_index) {
+            fs->free_inodes[i] = fs->free_inodes[--fs->free_inode_count];
+            break;
+        }
+    }
+}
+
+static void index_remove(FS* fs, int inode_index) {
+    int* link = &fs->name_buckets[hash_name(fs->inodes[inode_index].parent, fs->inodes[inode_index].name) & fs->bucket_mask];
+    while (*link != -1 && *link != inode_index) {
+        link = &fs->name_next[*link];
+    }
+    if (*link == inode_index) {
+        *link = fs->name_next[inode_index];
+    }
+    fs->free_inodes[fs->free_inode_count++] = inode_index;
+}
+
+static void build_name_index(FS* fs) {
+    memset(fs->name_buckets, -1, sizeof(int) * (fs->bucket_mask + 1));
+    fs->free_inode_count = 0;
+    int root = fs->superblock.features & FEATURE_DIRECTORIES ? fs->superblock.root_inode : -1;
+    for (int i = fs->superblock.total_inodes - 1; i >= 0; i--) {
+        if (fs->inodes[i].is_used == USED && i == root) {
+            continue; // the root directory has no name
+        }
+        if (fs->inodes[i].is_used == USED) {
+            fs->inodes[i].name[MAX_FILE_NAME - 1] = '\0';
+            index_link(fs, i);
+        } else {
+            fs->free_inodes[fs->free_inode_count++] = i;
+        }
+    }
+}
+
+// directories - B+ tree nodes are read and written through the extents of the directory inode
+static DIR_ENTRY* dir_entries(DIR_NODE* node) {
+    return (DIR_ENTRY*) (node + 1);
+}
+
+static DIR_NODE* dir_alloc_node(FS* fs) {
+    return (DIR_NODE*) calloc(1, fs->superblock.block_size + sizeof(DIR_ENTRY)); // room for one entry past a full node before it splits
+}
+
+static long long dir_node_offset(FS* fs, int dir, int logical_block) {
+    EXTENT_LIST* list = &fs->extents[dir];
+    int extent_index = extent_list_find(list, logical_block);
+    return block_offset(fs, list->extents[extent_index].start + logical_block - list->first_logical[extent_index]);
+}
+
+// nodes outside the directory or with an impossible entry count read as empty leaves
+static void dir_read_node(FS* fs, int dir, int logical_block, DIR_NODE* node) {
+    if (logical_block >= 0 && logical_block < extent_list_blocks(&fs->extents[dir])) {
+        meta_read(fs, dir_node_offset(fs, dir, logical_block), node, fs->superblock.block_size);
+        if (node->count >= 0 && node->count <= DIR_NODE_ENTRIES(fs)) {
+            return;
+        }
+    }
+    memset(node, 0, sizeof(DIR_NODE));
+    node->is_leaf = 1;
+    node->next_leaf = END_OF_FILE;
+}
+
+static void dir_write_node(FS* fs, int dir, int logical_block, DIR_NODE* node) {
+    meta_write(fs, dir_node_offset(fs, dir, logical_block), node, fs->superblock.block_size);
+}
+
+// index of the first entry of the node whose name sorts after name
+static int dir_upper_bound(DIR_NODE* node, char* name) {
+    DIR_ENTRY* entries = dir_entries(node);
+    int low = 0;
+    int high = node->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strncmp(entries[middle].name, name, MAX_FILE_NAME) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// append one block to a directory, next to its last block when possible - returns the logical block or -1 if the disk is full
+static int dir_add_block(FS* fs, int dir) {
+    EXTENT_LIST* list = &fs->extents[dir];
+    int hint = list->count > 0 ? list->extents[list->count - 1].start + list->extents[list->count - 1].length : 0;
+    int block_index = find_free_block(fs, hint < fs->superblock.total_data_blocks ? hint : 0);
+    if (block_index == -1) {
+        return -1;
+    }
+    set_block_used(fs, block_index);
+    int logical_block = extent_list_blocks(list);
+    extent_list_append(list, block_index, 1);
+    if (store_extents(fs, dir) == -1) {
+        if (--list->extents[list->count - 1].length == 0) {
+            list->count--;
+        }
+        set_block_free(fs, block_index);
+        store_extents(fs, dir);
+        return -1;
+    }
+    fs->inodes[dir].size += fs->superblock.block_size;
+    fs->superblock.used_user_space += fs->superblock.block_size;
+    mark_inode_dirty(fs, dir);
+    mark_superblock_dirty(fs);
+    return logical_block;
+}
+
+// insert entry into the subtree at logical_block, if the node splits split receives the first name and the logical block of the new right node
+static int dir_insert_node(FS* fs, int dir, int logical_block, DIR_ENTRY* entry, DIR_ENTRY* split, int depth) {
+    DIR_NODE* node = dir_alloc_node(fs);
+    dir_read_node(fs, dir, logical_block, node);
+    DIR_ENTRY* entries = dir_entries(node);
+    int position = dir_upper_bound(node, entry->name);
+    DIR_ENTRY child_split;
+    if (!node->is_leaf) {
+        int child = position > 0 ? position - 1 : 0;
+        if (node->count == 0 || depth == DIR_MAX_DEPTH
+            || !dir_insert_node(fs, dir, entries[child].inode, entry, &child_split, depth + 1)) {
+            free(node);
+            return 0;
+        }
+        entry = &child_split; // the new right child goes next to the one that split
+        position = child + 1;
+    }
+    memmove(&entries[position + 1], &entries[position], sizeof(DIR_ENTRY) * (node->count - position));
+    entries[position] = *entry;
+    node->count++;
+    int result = 0;
+    if (node->count > DIR_NODE_ENTRIES(fs)) {
+        int right_block = dir_add_block(fs, dir); // dir_insert made sure there is space for every split
+        DIR_NODE* right = dir_alloc_node(fs);
+        int left_count = node->count / 2;
+        right->is_leaf = node->is_leaf;
+        right->count = node->count - left_count;
+        right->next_leaf = END_OF_FILE;
+        memcpy(dir_entries(right), &entries[left_count], sizeof(DIR_ENTRY) * right->count);
+        node->count = left_count;
+        if (node->is_leaf) {
+            right->next_leaf = node->next_leaf;
+            node->next_leaf = right_block;
+        }
+        dir_write_node(fs, dir, right_block, right);
+        *split = dir_entries(right)[0];
+        split->inode = right_block;
+        free(right);
+        result = 1;
+    }
+    dir_write_node(fs, dir, logical_block, node);
+    free(node);
+    return result;
+}
+
+// number of node levels, found by following the first child of every inner node
+static int dir_depth(FS* fs, int dir) {
+    DIR_NODE* node = dir_alloc_node(fs);
+    int depth = 1;
+    dir_read_node(fs, dir, 0, node);
+    while (!node->is_leaf && node->count > 0 && depth < DIR_MAX_DEPTH) {
+        dir_read_node(fs, dir, dir_entries(node)[0].inode, node);
+        depth++;
+    }
+    free(node);
+    return depth;
+}
+
+// most node levels a directory of entries names can reach, every node but the root is at least half full
+static int dir_depth_for(int node_entries, long long entries) {
+    int depth = 1;
+    for (long long least = node_entries + 1; least <= entries; least *= node_entries / 2) {
+        depth++;
+    }
+    return depth;
+}
+
+// add a name to a directory, -1 if there may not be enough free blocks to split every node on the way
+static int dir_insert(FS* fs, int dir, char* name, int inode_index) {
+    int depth = dir_depth(fs, dir);
+    if (depth == DIR_MAX_DEPTH || fs->free_blocks < 2 * (depth + 1)) { // a new block and possibly an extent block per level and for a new root
+        return -1;
+    }
+    DIR_ENTRY entry;
+    memset(&entry, 0, sizeof(DIR_ENTRY));
+    strncpy(entry.name, name, MAX_FILE_NAME - 1);
+    entry.inode = inode_index;
+    DIR_ENTRY split;
+    if (dir_insert_node(fs, dir, 0, &entry, &split, 1)) {
+        // the root node split - its left half moves to a new block so the root stays at logical block 0
+        int left_block = dir_add_block(fs, dir);
+        DIR_NODE* node = dir_alloc_node(fs);
+        dir_read_node(fs, dir, 0, node);
+        dir_write_node(fs, dir, left_block, node);
+        memset(node, 0, fs->superblock.block_size);
+        node->is_leaf = 0;
+        node->count = 2;
+        node->next_leaf = END_OF_FILE;
+        dir_entries(node)[0].inode = left_block;
+        dir_entries(node)[1] = split;
+        dir_write_node(fs, dir, 0, node);
+        free(node);
+    }
+    return 0;
+}
+
+// remove a name from a directory, nodes are not merged so a leaf may become empty
+static void dir_remove(FS* fs, int dir, char* name) {
+    DIR_NODE* node = dir_alloc_node(fs);
+    int logical_block = 0;
+    for (int depth = 0; depth < DIR_MAX_DEPTH; depth++) {
+        dir_read_node(fs, dir, logical_block, node);
+        int position = dir_upper_bound(node, name);
+        DIR_ENTRY* entries = dir_entries(node);
+        if (node->is_leaf) {
+            if (position > 0 && strncmp(entries[position - 1].name, name, MAX_FILE_NAME) == 0) {
+                memmove(&entries[position - 1], &entries[position], sizeof(DIR_ENTRY) * (node->count - position));
+                node->count--;
+                dir_write_node(fs, dir, logical_block, node);
+            }
+            break;
+        }
+        if (node->count == 0) {
+            break;
+        }
+        logical_block = entries[position > 0 ? position - 1 : 0].inode;
+    }
+    free(node);
+}
+
+// read the first leaf of a directory into node, the leaves are chained in name order
+static void dir_first_leaf(FS* fs, int dir, DIR_NODE* node) {
+    dir_read_node(fs, dir, 0, node);
+    for (int depth = 1; !node->is_leaf && node->count > 0 && depth < DIR_MAX_DEPTH; depth++) {
+        dir_read_node(fs, dir, dir_entries(node)[0].inode, node);
+    }
+}
+
+static int dir_is_empty(FS* fs, int dir) {
+    DIR_NODE* node = dir_alloc_node(fs);
+    int empty = 1;
+    dir_first_leaf(fs, dir, node);
+    for (int leaves = 0; node->is_leaf && leaves < fs->inodes[dir].size / fs->superblock.block_size; leaves++) {
+        if (node->count > 0) {
+            empty = 0;
+            break;
+        }
+        if (node->next_leaf == END_OF_FILE) {
+            break;
+        }
+        dir_read_node(fs, dir, node->next_leaf, node);
+    }
+    free(node);
+    return empty;
+}
+
+// set up an unused inode as an empty directory with a single leaf as its root node, -1 if the disk is full
+static int create_directory(FS* fs, int inode_index, int parent, char* name) {
+    INODE* inode = &fs->inodes[inode_index];
+    memset(inode, 0, sizeof(INODE));
+    strncpy(inode->name, name, MAX_FILE_NAME - 1);
+    inode->type = TYPE_DIRECTORY;
+    inode->parent = parent;
+    inode->extent_block = END_OF_FILE;
+    fs->extents[inode_index].count = 0;
+    mark_inode_dirty(fs, inode_index);
+    if (dir_add_block(fs, inode_index) == -1) {
+        return -1;
+    }
+    DIR_NODE* node = dir_alloc_node(fs);
+    node->is_leaf = 1;
+    node->next_leaf = END_OF_FILE;
+    dir_write_node(fs, inode_index, 0, node);
+    free(node);
+    return 0;
+}
+
+// free the data blocks and extent blocks of an inode
+static void release_inode(FS* fs, int inode_index) {
+    release_extents(fs, &fs->extents[inode_index]);
+    release_extent_blocks(fs, &fs->inodes[inode_index]);
+    fs->inodes[inode_index].extent_count = 0;
+    fs->superblock.used_user_space -= stored_bytes(&fs->inodes[inode_index]);
+    fs->inodes[inode_index].size = 0;
+    fs->inodes[inode_index].stored_size = 0;
+    mark_inode_dirty(fs, inode_index);
+    mark_superblock_dirty(fs);
+}
+
+// walk path from the root directory - returns the inode it names, -1 if there is none, -2 if a name is too long
+// parent and name receive the directory that holds or would hold the last name, parent is -1 if that directory does not exist
+static int resolve_path(FS* fs, char* path, int* parent, char* name) {
+    int current = fs->superblock.root_inode;
+    *parent = -1;
+    name[0] = '\0';
+    while (1) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return current;
+        }
+        int length = strcspn(path, "/");
+        if (length >= MAX_FILE_NAME) {
+            *parent = -1;
+            return -2;
+        }
+        if (current == -1 || fs->inodes[current].type != TYPE_DIRECTORY) {
+            *parent = -1;
+            return -1;
+        }
+        memcpy(name, path, length);
+        name[length] = '\0';
+        path += length;
+        *parent = current;
+        current = get_inode_by_name(fs, current, name);
+        if (current == -1 && path[strspn(path, "/")] != '\0') {
+            *parent = -1; // a directory on the way is missing
+            return -1;
+        }
+    }
+}
+
+// inode of the regular file at path, -1 after printing why there is none
+static int find_file(FS* fs, char* path) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    int inode_index = resolve_path(fs, path, &parent, name);
+    if (inode_index < 0) {
+        printf("Error: file not found.\n");
+        return -1;
+    }
+    if (fs->inodes[inode_index].type == TYPE_DIRECTORY) {
+        printf("Error: file is a directory.\n");
+        return -1;
+    }
+    return inode_index;
+}
+
+// give images created before directories existed a root directory holding all their files
+static int upgrade_to_directories(FS* fs) {
+    int root = get_free_inode(fs);
+    if (root == -1 || create_directory(fs, root, root, "") == -1) {
+        return -1;
+    }
+    fs->inodes[root].is_used = USED;
+    fs->superblock.root_inode = root;
+    fs->superblock.features |= FEATURE_DIRECTORIES;
+    mark_superblock_dirty(fs);
+    for (int i = 0; i < fs->superblock.total_inodes; i++) {
+        if (i != root && fs->inodes[i].is_used == USED) {
+            fs->inodes[i].type = TYPE_FILE;
+            fs->inodes[i].parent = root;
+            mark_inode_dirty(fs, i);
+            if (dir_insert(fs, root, fs->inodes[i].name, i) == -1) {
+                return -1;
+            }
+        }
+    }
+    build_name_index(fs);
+    return 0;
+}
+
+// sharing - processes using the same disk file coordinate with open file description locks on parts of it: the superblock page
+// guards the metadata, shared by the commands that only read it and exclusive for the ones that change it, and the record of an
+// inode guards the data of its file while the file is copied without the metadata lock
+static int lock_range(int fd, int type, long long offset, long long length, int wait) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = length;
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+// lock the record of inode_index or with -1 the whole inode table, returns -1 when wait is 0 and another process holds a
+// conflicting lock
+static int lock_inode(FS* fs, int inode_index, int type, int wait) {
+    if (inode_index == -1) {
+        return lock_range(fs->fd, type, fs->superblock.inodes_offset, sizeof(INODE) * (long long) fs->superblock.total_inodes, wait);
+    }
+    return lock_range(fs->fd, type, fs->superblock.inodes_offset + sizeof(INODE) * (long long) inode_index, sizeof(INODE), wait);
+}
+
+// read the metadata again after another process changed it
+static int reload_metadata(FS* fs) {
+    SUPERBLOCK* superblock = &fs->superblock;
+    disk_read(fs, SUPERBLOCK_OFFSET, superblock, sizeof(SUPERBLOCK));
+    disk_read(fs, superblock->bitmap_offset, fs->free_map, sizeof(unsigned long long) * fs->map_words);
+    disk_read(fs, superblock->block_table_offset, fs->blocks, sizeof(BLOCK_META) * (long long) superblock->total_data_blocks);
+    disk_read(fs, superblock->inodes_offset, fs->inodes, sizeof(INODE) * (long long) superblock->total_inodes);
+    build_free_map(fs);
+    build_name_index(fs);
+    if (fs->dedup) {
+        build_dedup_index(fs);
+    }
+    cache_clear(fs);
+    free(fs->defrag_order); // the layout of an incremental defragmentation is planned again
+    fs->defrag_order = NULL;
+    fs->defrag_count = 0;
+    int result = 0;
+    for (int i = 0; i < superblock->total_inodes; i++) {
+        fs->extents[i].count = 0;
+        if (fs->inodes[i].is_used == USED && load_extents(fs, i) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// another process changed the metadata since this one last held the lock if the generation in the superblock moved, and a
+// process holding the exclusive lock also has to notice when the journal was emptied or got transactions past its head
+static void refresh_metadata(FS* fs) {
+    SUPERBLOCK superblock;
+    pread_all(fs->fd, &superblock, sizeof(SUPERBLOCK), SUPERBLOCK_OFFSET);
+    int changed = superblock.generation != fs->superblock.generation;
+    if (journal_enabled(fs) && fs->metadata_lock == F_WRLCK) {
+        JOURNAL_HEADER header;
+        TRANSACTION transaction;
+        memset(&transaction, 0, sizeof(TRANSACTION));
+        pread_all(fs->fd, &header, sizeof(JOURNAL_HEADER), fs->superblock.journal_offset);
+        if (fs->journal.head + (long long) sizeof(TRANSACTION) <= fs->superblock.journal_size) {
+            pread_all(fs->fd, &transaction, sizeof(TRANSACTION), fs->superblock.journal_offset + fs->journal.head);
+        }
+        if (header.magic_number != JOURNAL_MAGIC_NUMBER || header.sequence != fs->journal.base
+            || (transaction.magic_number == TRANSACTION_MAGIC_NUMBER && transaction.sequence == fs->journal.sequence)) {
+            // transactions of a process that stopped before writing them in place, replaying the ones already in place is harmless
+            fs->journal.sequence = journal_replay(fs->fd, &fs->superblock);
+            fs->journal.base = fs->journal.sequence;
+            fs->journal.head = PAGE_SIZE;
+            changed = 1;
+        }
+    }
+    if (changed) {
+        count_stat(&stats.metadata_reloads, 1);
+    }
+    if (changed && reload_metadata(fs) == -1) {
+        printf("Error: file system is corrupted.\n");
+    }
+}
+
+// take the metadata lock for a command, waiting for other processes - the exclusive lock stays held while this process has
+// uncommitted operations, so it already covers every command until the batch is committed
+static void lock_metadata(FS* fs, int type) {
+    if (fs->metadata_lock == F_WRLCK) {
+        return;
+    }
+    lock_range(fs->fd, type, SUPERBLOCK_OFFSET, PAGE_SIZE, 1);
+    fs->metadata_lock = type;
+    refresh_metadata(fs);
+}
+
+static void unlock_metadata(FS* fs) {
+    if (fs->journal.record_count > 0) {
+        return;
+    }
+    lock_range(fs->fd, F_UNLCK, SUPERBLOCK_OFFSET, PAGE_SIZE, 1);
+    fs->metadata_lock = F_UNLCK;
+}
+
+// wait for another process to release an inode this one found locked, without the metadata lock so that process can finish
+// its command - the caller takes the metadata lock again and retries
+static void wait_for_inode(FS* fs, int type, int inode_index) {
+    if (fs->journal.record_count > 0) {
+        journal_commit(fs); // a pending batch would keep the metadata locked
+    }
+    unlock_metadata(fs);
+    lock_inode(fs, inode_index, type, 1);
+    lock_inode(fs, inode_index, F_UNLCK, 1);
+}
+
+// allocate the in-memory state of a mounted file system described by superblock, the metadata stays resident with both backends
+static FS* alloc_fs(int fd, SUPERBLOCK* superblock, FS_OPTIONS* options) {
+    char* map = NULL;
+    if (options != NULL && options->backend == BACKEND_MMAP) {
+        map = (char*) mmap(NULL, superblock->total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error: could not map disk file.\n");
+            close(fd);
+            return NULL;
+        }
+    }
+    FS* fs = (FS*) malloc(sizeof(FS));
+    fs->fd = fd;
+    fs->map = map;
+    fs->superblock = *superblock;
+    fs->inodes = (INODE*) calloc(superblock->total_inodes, sizeof(INODE));
+    fs->extents = (EXTENT_LIST*) calloc(superblock->total_inodes, sizeof(EXTENT_LIST));
+    fs->blocks = (BLOCK_META*) calloc(superblock->total_data_blocks, sizeof(BLOCK_META));
+    fs->io_blocks = IO_SIZE / superblock->block_size > 0 ? IO_SIZE / superblock->block_size : 1;
+    fs->threads = options != NULL && options->threads > 0 ? options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    fs->threads = fs->threads < 1 ? 1 : fs->threads > MAX_THREADS ? MAX_THREADS : fs->threads;
+    fs->compress = options != NULL ? options->compress : CODEC_NONE;
+    fs->dedup = options != NULL && options->dedup;
+    fs->map_words = (superblock->total_data_blocks + 63) / 64;
+    fs->free_map = (unsigned long long*) calloc(fs->map_words, sizeof(unsigned long long));
+    fs->free_blocks = superblock->total_data_blocks;
+    fs->superblock_dirty = 0;
+    fs->inode_dirty = (char*) calloc(superblock->total_inodes, sizeof(char));
+    fs->dirty_inodes = (int*) malloc(sizeof(int) * superblock->total_inodes);
+    fs->dirty_inode_count = 0;
+    fs->block_dirty = (char*) calloc(superblock->total_data_blocks, sizeof(char));
+    fs->dirty_blocks = (int*) malloc(sizeof(int) * superblock->total_data_blocks);
+    fs->dirty_block_count = 0;
+    fs->defrag_order = NULL;
+    fs->defrag_count = 0;
+    fs->punch_blocks = NULL;
+    fs->punch_count = 0;
+    fs->punch_capacity = 0;
+    int buckets = 1;
+    while (buckets < superblock->total_inodes) {
+        buckets *= 2;
+    }
+    fs->name_buckets = (int*) malloc(sizeof(int) * buckets);
+    fs->name_next = (int*) malloc(sizeof(int) * superblock->total_inodes);
+    fs->bucket_mask = buckets - 1;
+    fs->free_inodes = (int*) malloc(sizeof(int) * superblock->total_inodes);
+    fs->free_inode_count = 0;
+    fs->dedup_buckets = NULL; // see build_dedup_index
+    fs->dedup_next = NULL;
+    fs->dedup_mask = 0;
+    JOURNAL* journal = &fs->journal;
+    journal->capacity = 1 << 16;
+    journal->buffer = (char*) malloc(journal->capacity);
+    journal->record_capacity = 256;
+    journal->record_positions = (long long*) malloc(sizeof(long long) * journal->record_capacity);
+    journal->record_next = (int*) malloc(sizeof(int) * journal->record_capacity);
+    journal->buckets = (int*) malloc(sizeof(int) * JOURNAL_BUCKETS);
+    memset(journal->buckets, -1, sizeof(int) * JOURNAL_BUCKETS);
+    journal->record_count = 0;
+    journal_clear(journal);
+    journal->head = PAGE_SIZE;
+    journal->sequence = 0;
+    journal->base = 0;
+    journal->batch = options != NULL && options->batch > 0 ? options->batch : DEFAULT_BATCH;
+    cache_init(fs, options != NULL ? options->cache_size : DEFAULT_CACHE_SIZE);
+    pthread_mutex_init(&fs->cache.lock, NULL);
+    fs->metadata_lock = F_UNLCK;
+    return fs;
+}
+
+static void free_fs(FS* fs) {
+    if (fs->map != NULL) {
+        munmap(fs->map, fs->superblock.total_size);
+    }
+    close(fs->fd);
+    for (int i = 0; i < fs->superblock.total_inodes; i++) {
+        free(fs->extents[i].extents);
+        free(fs->extents[i].first_logical);
+    }
+    free(fs->inodes);
+    free(fs->extents);
+    free(fs->blocks);
+    free(fs->free_map);
+    free(fs->inode_dirty);
+    free(fs->dirty_inodes);
+    free(fs->block_dirty);
+    free(fs->dirty_blocks);
+    free(fs->defrag_order);
+    free(fs->name_buckets);
+    free(fs->name_next);
+    free(fs->free_inodes);
+    free(fs->dedup_buckets);
+    free(fs->dedup_next);
+    free(fs->punch_blocks);
+    free(fs->journal.buffer);
+    free(fs->journal.record_positions);
+    free(fs->journal.record_next);
+    free(fs->journal.buckets);
+    cache_free(fs);
+    pthread_mutex_destroy(&fs->cache.lock);
+    free(fs);
+}
+
+static int valid_block_size(int block_size) {
+    return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
+}
+
+FS* init_fs(char* fs_name, int blocks, int block_size, int inodes, FS_OPTIONS* options) {
+    if (blocks <= 0) {
+        printf("Error: invalid number of data blocks.\n");
+        return NULL;
+    }
+    if (!valid_block_size(block_size)) {
+        printf("Error: block size must be a power of two between %d and %d bytes.\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return NULL;
+    }
+    if (inodes <= 0 || inodes > MAX_INODES) {
+        printf("Error: number of inodes must be between 1 and %d.\n", MAX_INODES);
+        return NULL;
+    }
+    int fd = open(fs_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        printf("Error: could not create disk file.\n");
+        return NULL;
+    }
+    SUPERBLOCK superblock;
+    memset(&superblock, 0, sizeof(SUPERBLOCK));
+    superblock.magic_number = MAGIC_NUMBER; // magic number to identify if the file is file system
+    superblock.total_inodes = inodes; // every file has an inode
+    superblock.total_data_blocks = blocks;
+    superblock.user_space = (long long) blocks * block_size; // user space = data blocks only
+    superblock.used_user_space = 0;
+    superblock.block_size = block_size;
+    superblock.features = FEATURE_DIRECTORIES | FEATURE_JOURNAL;
+    superblock.root_inode = 0;
+    superblock.journal_size = journal_size_for(&superblock);
+    compute_layout(&superblock);
+    // an all-zero bitmap, block table and inode table describe an empty file system, so the disk file starts as one hole and
+    // the host only stores what gets written
+    if (ftruncate(fd, superblock.total_size) == -1) {
         printf("Error: could not create disk file.\n");
+        close(fd);
+        return NULL;
+    }
+    pwrite_all(fd, &superblock, sizeof(SUPERBLOCK), SUPERBLOCK_OFFSET); // write superblock to file
+    FS* fs = alloc_fs(fd, &superblock, options);
+    if (fs == NULL) {
+        return NULL;
+    }
+    lock_range(fd, F_WRLCK, SUPERBLOCK_OFFSET, PAGE_SIZE, 1);
+    fs->metadata_lock = F_WRLCK;
+    journal_reset(fd, &superblock, 0);
+    build_free_map(fs);
+    create_directory(fs, 0, 0, ""); // there is at least one data block for the root node
+    fs->inodes[0].is_used = USED;
+    build_name_index(fs);
+    if (fs->dedup) {
+        build_dedup_index(fs);
+    }
+    write_dirty(fs);
+    journal_commit(fs);
+    unlock_metadata(fs);
+    return fs;
+}
+
+static int valid_superblock(SUPERBLOCK* superblock, long long file_size) {
+    SUPERBLOCK layout = *superblock;
+    compute_layout(&layout);
+    int journal_valid = superblock->features & FEATURE_JOURNAL ? superblock->journal_size >= 2 * PAGE_SIZE && superblock->journal_size % PAGE_SIZE == 0
+                                                                : superblock->journal_size == 0;
+    return superblock->total_inodes > 0 && superblock->total_inodes <= MAX_INODES && valid_block_size(superblock->block_size) && superblock->total_data_blocks > 0
+        && journal_valid && memcmp(&layout, superblock, sizeof(SUPERBLOCK)) == 0 && file_size >= superblock->total_size;
+}
+
+FS* select_fs(char* fs_name, FS_OPTIONS* options) {
+    int fd = open(fs_name, O_RDWR);
+    if (fd == -1) {
+        printf("Error: could not open disk file.\n");
+        return NULL;
+    }
+    // other processes wait until the image is recovered and upgraded, closing fd releases the lock
+    lock_range(fd, F_WRLCK, SUPERBLOCK_OFFSET, PAGE_SIZE, 1);
+    // load and validate superblock
+    SUPERBLOCK superblock;
+    memset(&superblock, 0, sizeof(SUPERBLOCK));
+    pread_all(fd, &superblock, sizeof(SUPERBLOCK), SUPERBLOCK_OFFSET);
+    if (superblock.magic_number == LEGACY_MAGIC_NUMBER || superblock.magic_number == EXTENT_MAGIC_NUMBER) {
+        printf("Error: file system uses an old disk format, convert it first.\n");
+        close(fd);
+        return NULL;
+    }
+    if (superblock.magic_number != MAGIC_NUMBER) {
+        printf("Error: file is not a file system.\n");
+        close(fd);
+        return NULL;
+    }
+    if (superblock.features & ~KNOWN_FEATURES) {
+        printf("Error: file system uses features this version does not support.\n");
+        close(fd);
+        return NULL;
+    }
+    long long file_size = lseek(fd, 0, SEEK_END);
+    if (!valid_superblock(&superblock, file_size)) {
+        printf("Error: file system is corrupted.\n");
+        close(fd);
+        return NULL;
+    }
+    unsigned int sequence = 0;
+    if (superblock.features & FEATURE_JOURNAL) {
+        // finish the operations committed before a crash, the superblock may be one of the records
+        sequence = journal_replay(fd, &superblock);
+        pread_all(fd, &superblock, sizeof(SUPERBLOCK), SUPERBLOCK_OFFSET);
+        if (!valid_superblock(&superblock, file_size)) {
+            printf("Error: file system is corrupted.\n");
+            close(fd);
+            return NULL;
+        }
+    }
+    FS* fs = alloc_fs(fd, &superblock, options);
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->journal.sequence = sequence;
+    fs->journal.base = sequence;
+    fs->metadata_lock = F_WRLCK;
+    // bitmap, block table, inodes and extents stay resident until the file system is closed
+    if (reload_metadata(fs) == -1) {
+        printf("Error: file system is corrupted.\n");
+        free_fs(fs);
+        return NULL;
+    }
+    if (!(superblock.features & FEATURE_DIRECTORIES)) {
+        // only free blocks of the disk file change until the upgrade is complete
+        if (upgrade_to_directories(fs) == -1) {
+            printf("Error: no free inode or data blocks for the root directory.\n");
+            free_fs(fs);
+            return NULL;
+        }
+        write_dirty(fs);
+    }
+    int root = fs->superblock.root_inode;
+    if (root < 0 || root >= superblock.total_inodes || fs->inodes[root].is_used != USED
+        || fs->inodes[root].type != TYPE_DIRECTORY || fs->extents[root].count == 0) {
+        printf("Error: file system is corrupted.\n");
+        free_fs(fs);
+        return NULL;
+    }
+    unlock_metadata(fs);
+    return fs;
+}
+
+void close_fs(FS* fs) {
+    if (fs == NULL) {
         return;
     }
-    superblock = (SUPERBLOCK*) malloc(sizeof(SUPERBLOCK)); // allocate memory for superblock
-    superblock->magic_number = MAGIC_NUMBER; // magic number to identify if the file is file system
-    superblock->total_inodes = MAX_FILES; // every file has an inode
-    superblock->total_data_blocks = blocks;
-    superblock->user_space = blocks * BLOCK_SIZE; // user space = data blocks only
-    superblock->used_user_space = 0;
-    superblock->block_size = BLOCK_SIZE;
-    superblock->total_size = sizeof(SUPERBLOCK) + (sizeof(INODE) * MAX_FILES) + (sizeof(DATA_BLOCK) * blocks);
-    fwrite(superblock, sizeof(SUPERBLOCK), 1, fs); // write superblock to file
-    inodes = (INODE*) malloc(sizeof(INODE) * MAX_FILES); // allocate memory for inodes
-    for (int i = 0; i < MAX_FILES; i++) {
-        inodes[i].name[0] = '\0';
-        inodes[i].is_used = NOT_USED;
-        inodes[i].size = 0;
-        inodes[i].first_block = END_OF_FILE;
-    }
-    fwrite(inodes, sizeof(INODE), MAX_FILES, fs); // write inodes to file
-    data_blocks = (DATA_BLOCK*) malloc(sizeof(DATA_BLOCK) * blocks); // allocate memory for data blocks
-    for (int i = 0; i < blocks; i++) {
-        data_blocks[i].is_used = NOT_USED;
-        data_blocks[i].next_block = END_OF_FILE;
-    }
-    fwrite(data_blocks, sizeof(DATA_BLOCK), blocks, fs); // write data blocks to file
-    fclose(fs);
-}
-
-void select_fs(char* fs_name) {
-    FILE* fs = fopen(fs_name, "r+");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+    lock_metadata(fs, F_WRLCK);
+    write_dirty(fs);
+    if (journal_enabled(fs)) {
+        journal_commit(fs);
+        journal_checkpoint(fs); // a cleanly closed image has an empty journal
+    }
+    free_fs(fs);
+}
+
+// make every operation so far durable without waiting for the batch to fill
+int sync_fs(FS* fs) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    lock_metadata(fs, F_WRLCK);
+    if (journal_enabled(fs)) {
+        journal_commit(fs);
+    } else {
+        fdatasync(fs->fd);
+        count_stat(&stats.sync_calls, 1);
+    }
+    unlock_metadata(fs);
+    return 0;
+}
+
+// replace the block cache with one of megabytes MiB, 0 turns it off
+int resize_cache(FS* fs, int megabytes) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    cache_free(fs);
+    cache_init(fs, megabytes);
+    return 0;
+}
+
+// turn deduplication of the files copied in on or off, the index of the stored blocks is only kept while it is on
+int set_dedup(FS* fs, int on) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    fs->dedup = on;
+    if (on) {
+        build_dedup_index(fs);
+    } else {
+        free(fs->dedup_buckets);
+        free(fs->dedup_next);
+        fs->dedup_buckets = NULL;
+        fs->dedup_next = NULL;
+    }
+    return 0;
+}
+
+// give inode_index a file entry named name in parent and the data blocks for size bytes compressed with codec, it becomes used in link_file
+static int allocate_file(FS* fs, int inode_index, int parent, char* name, long long size, int codec) {
+    int block_size = fs->superblock.block_size;
+    INODE* inode = &fs->inodes[inode_index];
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    memset(inode, 0, sizeof(INODE));
+    strcpy(inode->name, name);
+    inode->type = TYPE_FILE;
+    inode->parent = parent;
+    inode->extent_block = END_OF_FILE;
+    inode->codec = size > 0 ? codec : CODEC_NONE;
+    list->count = 0;
+    allocate_extents(fs, (size + block_size - 1) / block_size, list); // compressed data is smaller or the file is stored as it is
+    if (store_extents(fs, inode_index) == -1) {
+        release_extents(fs, list);
+        return -1;
+    }
+    return 0;
+}
+
+// zero the part of the last block of inode_index past the end of its data
+static void zero_file_tail(FS* fs, int inode_index, long long file_size) {
+    int block_size = fs->superblock.block_size;
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    if (file_size % block_size != 0) {
+        EXTENT* last = &list->extents[list->count - 1];
+        long long tail = block_size - file_size % block_size;
+        char* zeros = (char*) calloc(tail, 1);
+        disk_write(fs, block_offset(fs, last->start + last->length) - tail, zeros, tail);
+        free(zeros);
+    }
+}
+
+// free the blocks of inode_index past the first bytes bytes of its data
+static void trim_extents(FS* fs, int inode_index, long long bytes) {
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    int keep = (bytes + fs->superblock.block_size - 1) / fs->superblock.block_size;
+    int count = 0;
+    for (int i = 0; i < list->count; i++) {
+        EXTENT* extent = &list->extents[i];
+        int kept = keep - list->first_logical[i];
+        kept = kept < 0 ? 0 : kept < extent->length ? kept : extent->length;
+        for (int j = extent->start + kept; j < extent->start + extent->length; j++) {
+            release_block(fs, j);
+        }
+        extent->length = kept;
+        count = kept > 0 ? i + 1 : count;
+    }
+    list->count = count;
+    store_extents(fs, inode_index); // needs fewer extent blocks than it frees
+}
+
+// add a file to its directory, it stays empty until ingest_data has its data in place
+static int link_file(FS* fs, int inode_index) {
+    INODE* inode = &fs->inodes[inode_index];
+    if (dir_insert(fs, inode->parent, inode->name, inode_index) == -1) {
+        return -1;
+    }
+    inode->size = 0;
+    inode->is_used = USED; // set inode as used
+    index_add(fs, inode_index);
+    mark_inode_dirty(fs, inode_index);
+    return 0;
+}
+
+// take a used file or directory out of its directory and free its inode and data blocks
+static void remove_entry(FS* fs, int inode_index) {
+    dir_remove(fs, fs->inodes[inode_index].parent, fs->inodes[inode_index].name);
+    index_remove(fs, inode_index);
+    // free data blocks and extent blocks by setting them as not used
+    release_inode(fs, inode_index);
+    fs->inodes[inode_index].is_used = NOT_USED; // set inode as not used
+}
+
+// one file or directory of a copy_files_to_fs batch
+typedef struct ingest_entry {
+    char* path;
+    int parent; // entry of the directory holding it, -1 for the destination directory
+    char name[MAX_FILE_NAME];
+    int type;
+    long long size;
+    int inode; // -1 once the entry failed
+    int borrows; // shares blocks another file of the batch writes, it fails with any file of the batch
+} INGEST_ENTRY;
+
+// full block a batch writes, later blocks of the batch with the same data share it - the data is not on the disk yet, so it is
+// compared with the file it comes from
+typedef struct pending_block {
+    unsigned int checksum;
+    int block;
+    int entry;
+    long long offset; // of the data in the file of entry
+    int next; // pending blocks chained by hash of the checksum
+} PENDING_BLOCK;
+
+typedef struct ingest_batch {
+    INGEST_ENTRY* entries;
+    int count;
+    int capacity;
+    int directories;
+    long long blocks; // data blocks of the files
+    PENDING_BLOCK* pending;
+    int pending_count;
+    int pending_capacity;
+    int* pending_buckets; // DEDUP_BUCKETS, allocated with the first pending block
+} INGEST_BATCH;
+
+// pending block of the batch holding the same data as data, returns -1 if there is none
+static int pending_find(FS* fs, INGEST_BATCH* batch, unsigned int checksum, char* data, char* scratch) {
+    int block_size = fs->superblock.block_size;
+    if (batch->pending_buckets == NULL) {
+        return -1;
+    }
+    for (int i = batch->pending_buckets[checksum % DEDUP_BUCKETS]; i != -1; i = batch->pending[i].next) {
+        PENDING_BLOCK* pending = &batch->pending[i];
+        if (pending->checksum != checksum || fs->blocks[pending->block].extra_refs == INT_MAX) {
+            continue;
+        }
+        int fd = open(batch->entries[pending->entry].path, O_RDONLY);
+        long long got = fd == -1 ? -1 : pread_all(fd, scratch, block_size, pending->offset);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (got == block_size && memcmp(scratch, data, block_size) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void pending_add(INGEST_BATCH* batch, unsigned int checksum, int block_index, int entry, long long offset) {
+    if (batch->pending_buckets == NULL) {
+        batch->pending_buckets = (int*) malloc(sizeof(int) * DEDUP_BUCKETS);
+        memset(batch->pending_buckets, -1, sizeof(int) * DEDUP_BUCKETS);
+    }
+    if (batch->pending_count == batch->pending_capacity) {
+        batch->pending_capacity = batch->pending_capacity == 0 ? 256 : batch->pending_capacity * 2;
+        batch->pending = (PENDING_BLOCK*) realloc(batch->pending, sizeof(PENDING_BLOCK) * batch->pending_capacity);
+    }
+    PENDING_BLOCK* pending = &batch->pending[batch->pending_count];
+    pending->checksum = checksum;
+    pending->block = block_index;
+    pending->entry = entry;
+    pending->offset = offset;
+    pending->next = batch->pending_buckets[checksum % DEDUP_BUCKETS];
+    batch->pending_buckets[checksum % DEDUP_BUCKETS] = batch->pending_count++;
+}
+
+// read the file of a batch entry once to find its full blocks that hold the same data as a stored block or a block the batch
+// writes, share those and give back the blocks allocated for them, then queue the transfers of the blocks it still writes
+static void dedup_file(FS* fs, INGEST_BATCH* batch, TRANSFER_QUEUE* queue, int index) {
+    INGEST_ENTRY* entry = &batch->entries[index];
+    EXTENT_LIST* list = &fs->extents[entry->inode];
+    int block_size = fs->superblock.block_size;
+    int block_count = extent_list_blocks(list);
+    int* blocks = (int*) malloc(sizeof(int) * block_count); // block holding each block of the file
+    char* written = (char*) malloc(block_count); // set for the blocks the file writes itself
+    for (int i = 0; i < list->count; i++) {
+        for (int j = 0; j < list->extents[i].length; j++) {
+            blocks[list->first_logical[i] + j] = list->extents[i].start + j;
+        }
+    }
+    memset(written, 1, block_count);
+    char* data = (char*) malloc(IO_SIZE + block_size);
+    char* scratch = data + IO_SIZE;
+    int fd = open(entry->path, O_RDONLY);
+    long long full_size = entry->size / block_size * block_size;
+    for (long long done = 0; fd != -1 && done < full_size;) {
+        long long count = full_size - done < (long long) fs->io_blocks * block_size ? full_size - done : (long long) fs->io_blocks * block_size;
+        if (pread_all(fd, data, count, done) != count) {
+            break; // the transfer reports the error
+        }
+        for (int i = 0; i < count / block_size; i++) {
+            int logical = done / block_size + i;
+            char* block = data + (long long) i * block_size;
+            unsigned int checksum = block_checksum(fs, block);
+            int match = dedup_find(fs, checksum, block, scratch);
+            int pending = match == -1 ? pending_find(fs, batch, checksum, block, scratch) : -1;
+            if (pending != -1) {
+                match = batch->pending[pending].block;
+                entry->borrows |= batch->pending[pending].entry != index;
+            }
+            if (match == -1) {
+                pending_add(batch, checksum, blocks[logical], index, (long long) logical * block_size);
+                continue;
+            }
+            set_block_free(fs, blocks[logical]);
+            blocks[logical] = match;
+            written[logical] = 0;
+            fs->blocks[match].extra_refs++;
+            count_stat(&stats.blocks_shared, 1);
+            fs->superblock.used_user_space -= block_size;
+            fs->superblock.features |= FEATURE_DEDUP;
+            mark_block_dirty(fs, match);
+            mark_superblock_dirty(fs);
+        }
+        done += count;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(data);
+    list->count = 0;
+    for (int i = 0; i < block_count; i++) {
+        extent_list_append(list, blocks[i], 1);
+    }
+    store_extents(fs, entry->inode); // the blocks given back cover the extent blocks
+    // transfers of the runs of adjacent blocks the file writes
+    for (int i = 0; i < block_count;) {
+        if (!written[i]) {
+            i++;
+            continue;
+        }
+        int length = 1;
+        while (i + length < block_count && written[i + length] && blocks[i + length] == blocks[i] + length && (long long) length * block_size < TRANSFER_SIZE) {
+            length++;
+        }
+        long long bytes = entry->size - (long long) i * block_size < (long long) length * block_size ? entry->size - (long long) i * block_size : (long long) length * block_size;
+        TRANSFER* transfer = queue_add(queue, entry->path, bytes, 1, index);
+        transfer->file_offset = (long long) i * block_size;
+        transfer->disk_offset = block_offset(fs, blocks[i]);
+        i += length;
+    }
+    free(blocks);
+    free(written);
+}
+
+// link the allocated entries of a batch, a directory before anything in it, and copy the file data with only the records of the
+// new files locked so other processes can use the file system meanwhile - the files get their sizes once the data is in place
+static int ingest_data(FS* fs, INGEST_BATCH* batch, int destination) {
+    int result = 0;
+    for (int i = 0; i < batch->count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[i];
+        if (entry->inode == -1) {
+            continue;
+        }
+        int parent_inode = entry->parent == -1 ? destination : batch->entries[entry->parent].inode;
+        if (parent_inode == -1 || get_inode_by_name(fs, parent_inode, entry->name) != -1) {
+            if (parent_inode != -1) {
+                printf("Error: file %s already exists.\n", entry->name);
+                result = -1;
+            }
+            release_inode(fs, entry->inode);
+            entry->inode = -1;
+            continue;
+        }
+        if (entry->type == TYPE_FILE ? link_file(fs, entry->inode) == -1 : dir_insert(fs, parent_inode, entry->name, entry->inode) == -1) {
+            printf("Error: no available data blocks for %s.\n", entry->path);
+            release_inode(fs, entry->inode);
+            entry->inode = -1;
+            result = -1;
+            continue;
+        }
+        if (entry->type == TYPE_DIRECTORY) {
+            fs->inodes[entry->inode].is_used = USED;
+            index_add(fs, entry->inode);
+        }
+    }
+    write_dirty(fs);
+    // file data, the files of the batch and the block ranges of large files are copied in parallel
+    TRANSFER_QUEUE queue;
+    queue_init(&queue, fs);
+    int deduplicated = 0;
+    for (int i = 0; i < batch->count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[i];
+        if (entry->type == TYPE_FILE && entry->inode != -1) {
+            lock_inode(fs, entry->inode, F_WRLCK, 1); // no other process locks a free inode
+            if (fs->dedup && fs->inodes[entry->inode].codec == CODEC_NONE && entry->size >= fs->superblock.block_size) {
+                dedup_file(fs, batch, &queue, i);
+                deduplicated = 1;
+            } else {
+                queue_file(&queue, entry->inode, entry->path, entry->size, 1, i);
+            }
+            if (fs->inodes[entry->inode].codec == CODEC_NONE) {
+                zero_file_tail(fs, entry->inode, entry->size);
+            }
+        }
+    }
+    if (deduplicated) {
+        write_dirty(fs); // other processes must see the shared blocks before they get the lock
+    }
+    unlock_metadata(fs);
+    int failed = run_transfers(&queue);
+    lock_metadata(fs, F_WRLCK);
+    for (int i = 0; i < queue.count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[queue.transfers[i].owner];
+        if (queue.transfers[i].failed && entry->inode != -1) {
+            printf("Error: could not read file %s.\n", entry->path);
+            remove_entry(fs, entry->inode);
+            lock_inode(fs, entry->inode, F_UNLCK, 1);
+            entry->inode = -1;
+            result = -1;
+        } else if (!queue.transfers[i].failed && queue.transfers[i].stored_raw) {
+            fs->inodes[entry->inode].codec = CODEC_NONE;
+        } else if (!queue.transfers[i].failed && queue.transfers[i].codec != CODEC_NONE) {
+            fs->inodes[entry->inode].stored_size = queue.transfers[i].stored;
+        }
+    }
+    for (int i = 0; i < batch->count && failed == -1; i++) {
+        // the blocks a file borrowed may be the ones a failed file did not write
+        INGEST_ENTRY* entry = &batch->entries[i];
+        if (entry->borrows && entry->inode != -1) {
+            printf("Error: file %s shares data with a file that could not be read.\n", entry->path);
+            remove_entry(fs, entry->inode);
+            lock_inode(fs, entry->inode, F_UNLCK, 1);
+            entry->inode = -1;
+        }
+    }
+    free(batch->pending);
+    free(batch->pending_buckets);
+    batch->pending = NULL;
+    batch->pending_buckets = NULL;
+    batch->pending_count = 0;
+    for (int i = 0; i < batch->count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[i];
+        if (entry->type == TYPE_FILE && entry->inode != -1) {
+            INODE* inode = &fs->inodes[entry->inode];
+            inode->size = entry->size;
+            if (inode->codec != CODEC_NONE) {
+                // give back the blocks the compressed data did not need
+                trim_extents(fs, entry->inode, inode->stored_size);
+                fs->superblock.features |= FEATURE_COMPRESSION;
+            }
+            fs->superblock.used_user_space += stored_bytes(inode); // update used user space
+            mark_inode_dirty(fs, entry->inode);
+            lock_inode(fs, entry->inode, F_UNLCK, 1);
+        }
+    }
+    // the blocks the batch wrote get their checksums, and later copies share them from now on
+    for (int i = 0; i < queue.count; i++) {
+        TRANSFER* transfer = &queue.transfers[i];
+        int inode_index = batch->entries[transfer->owner].inode;
+        if (inode_index == -1 || transfer->failed) {
+            continue;
+        }
+        EXTENT_LIST* list = &fs->extents[inode_index];
+        int first_block = (transfer->disk_offset - fs->superblock.data_offset) / fs->superblock.block_size;
+        for (int j = 0; j < transfer->checksum_count; j++) {
+            int block_index = first_block + j;
+            if (transfer->codec != CODEC_NONE) {
+                int extent = extent_list_find(list, j);
+                block_index = list->extents[extent].start + j - list->first_logical[extent];
+            }
+            fs->blocks[block_index].checksum = transfer->checksums[j];
+            dedup_add(fs, block_index);
+            mark_block_dirty(fs, block_index);
+        }
+    }
+    queue_free(&queue);
+    mark_superblock_dirty(fs);
+    // write back only the superblock, inodes, bitmap and block table entries that changed
+    write_dirty(fs);
+    return result;
+}
+
+static int copy_file_to_fs_locked(FS* fs, char* path_to_file, char* fs_path) {
+    // a destination that is a directory keeps the name of the copied file, otherwise its last name is the new file name
+    int parent;
+    char file_name[MAX_FILE_NAME];
+    int target = resolve_path(fs, fs_path, &parent, file_name);
+    if (target >= 0 && fs->inodes[target].type == TYPE_DIRECTORY) {
+        char* base_name = strrchr(path_to_file, '/');
+        base_name = base_name == NULL ? path_to_file : base_name + 1; // skip '/'
+        if (strlen(base_name) >= MAX_FILE_NAME) {
+            printf("Error: file name too long.\n");
+            return -1;
+        }
+        parent = target;
+        strcpy(file_name, base_name);
+        target = get_inode_by_name(fs, parent, file_name);
+    }
+    if (target == -2) {
+        printf("Error: file name too long.\n");
+        return -1;
+    }
+    if (target >= 0) {
+        printf("Error: file already exists.\n");
+        return -1;
+    }
+    if (parent == -1) {
+        printf("Error: directory not found.\n");
+        return -1;
+    }
+    int inode_index = get_free_inode(fs);
+    if (inode_index == -1) {
+        printf("Error: no available inodes.\n");
+        return -1;
+    }
+    // open file to copy
+    int fd = open(path_to_file, O_RDONLY);
+    if (fd == -1) {
+        printf("Error: could not open file.\n");
+        return -1;
+    }
+    long long file_size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    if (file_size > fs->superblock.user_space) {
+        printf("Error: file too large.\n");
+        return -1;
+    }
+    int block_size = fs->superblock.block_size;
+    if (fs->free_blocks < (file_size + block_size - 1) / block_size
+        || allocate_file(fs, inode_index, parent, file_name, file_size, fs->compress) == -1) {
+        printf("Error: no available data blocks.\n");
+        return -1;
+    }
+    // large files are copied by several threads, a range of blocks each
+    INGEST_ENTRY entry = {path_to_file, -1, "", TYPE_FILE, file_size, inode_index, 0};
+    strcpy(entry.name, file_name);
+    INGEST_BATCH batch = {&entry, 1, 1, 0, 0, NULL, 0, 0, NULL};
+    return ingest_data(fs, &batch, parent);
+}
+
+int copy_file_to_fs(FS* fs, char* path_to_file, char* fs_path) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    lock_metadata(fs, F_WRLCK);
+    int result = copy_file_to_fs_locked(fs, path_to_file, fs_path);
+    unlock_metadata(fs);
+    return result;
+}
+
+// add path and, for a directory, everything below it in name order - parents always come before their entries
+static int ingest_add(FS* fs, INGEST_BATCH* batch, char* path, int parent) {
+    struct stat info;
+    if (stat(path, &info) == -1 || (!S_ISREG(info.st_mode) && !S_ISDIR(info.st_mode))) {
+        printf("Error: could not open file %s.\n", path);
+        return -1;
+    }
+    int length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--; // dir/ names dir
+    }
+    int start = length;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (length - start >= MAX_FILE_NAME) {
+        printf("Error: file name too long.\n");
+        return -1;
+    }
+    if (length == start || strncmp(path + start, ".", length - start) == 0 || strncmp(path + start, "..", length - start) == 0) {
+        printf("Error: %s has no name to copy it under.\n", path);
+        return -1;
+    }
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        batch->entries = (INGEST_ENTRY*) realloc(batch->entries, sizeof(INGEST_ENTRY) * batch->capacity);
+    }
+    int index = batch->count++;
+    INGEST_ENTRY* entry = &batch->entries[index];
+    entry->path = strdup(path);
+    entry->parent = parent;
+    memset(entry->name, 0, MAX_FILE_NAME);
+    memcpy(entry->name, path + start, length - start);
+    entry->type = S_ISDIR(info.st_mode) ? TYPE_DIRECTORY : TYPE_FILE;
+    entry->size = S_ISDIR(info.st_mode) ? 0 : info.st_size;
+    entry->inode = -1;
+    entry->borrows = 0;
+    if (!S_ISDIR(info.st_mode)) {
+        batch->blocks += (info.st_size + fs->superblock.block_size - 1) / fs->superblock.block_size;
+        return 0;
+    }
+    batch->directories++;
+    struct dirent** names;
+    int count = scandir(path, &names, NULL, alphasort);
+    if (count == -1) {
+        printf("Error: could not open directory %s.\n", path);
+        return -1;
+    }
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i]->d_name, ".") != 0 && strcmp(names[i]->d_name, "..") != 0 && result == 0) {
+            char* child = (char*) malloc(strlen(path) + strlen(names[i]->d_name) + 2);
+            sprintf(child, "%s/%s", path, names[i]->d_name);
+            result = ingest_add(fs, batch, child, index);
+            free(child);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+static int copy_files_to_fs_locked(FS* fs, INGEST_BATCH* batch, char** paths, int count, char* fs_path) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    int destination = resolve_path(fs, fs_path, &parent, name);
+    if (destination < 0 || fs->inodes[destination].type != TYPE_DIRECTORY) {
+        printf("Error: directory not found.\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ingest_add(fs, batch, paths[i], -1) == -1) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->entries[i].parent == -1 && get_inode_by_name(fs, destination, batch->entries[i].name) != -1) {
+            printf("Error: file %s already exists.\n", batch->entries[i].name);
+            return -1;
+        }
+    }
+    // every directory gets a root node, the directories it fills grow by up to two blocks per node of entries, and the last
+    // dir_insert still wants two blocks per level of the destination once the batch may have made it deeper
+    int depth = dir_depth(fs, destination) + dir_depth_for(DIR_NODE_ENTRIES(fs), batch->count);
+    long long directory_blocks = batch->directories + 2LL * batch->count / DIR_NODE_ENTRIES(fs) + 2 * (depth + 1);
+    if (batch->count > fs->free_inode_count) {
+        printf("Error: no available inodes.\n");
+        return -1;
+    }
+    if (batch->blocks + directory_blocks > fs->free_blocks) {
+        printf("Error: no available data blocks.\n");
+        return -1;
+    }
+    // inodes come off the top of the free stack in batch order and leave it as the entries are linked
+    int result = 0;
+    for (int i = 0; i < batch->count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[i];
+        int inode_index = fs->free_inodes[fs->free_inode_count - 1 - i];
+        int parent_inode = entry->parent == -1 ? destination : batch->entries[entry->parent].inode;
+        if (entry->type == TYPE_FILE && allocate_file(fs, inode_index, parent_inode, entry->name, entry->size, fs->compress) == -1) {
+            printf("Error: no available data blocks for %s.\n", entry->path);
+            result = -1;
+            continue;
+        }
+        entry->inode = inode_index;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        INGEST_ENTRY* entry = &batch->entries[i];
+        int parent_inode = entry->parent == -1 ? destination : batch->entries[entry->parent].inode;
+        if (entry->type == TYPE_DIRECTORY && create_directory(fs, entry->inode, parent_inode, entry->name) == -1) {
+            printf("Error: no available data blocks for %s.\n", entry->path);
+            release_inode(fs, entry->inode);
+            entry->inode = -1;
+            result = -1;
+        }
+    }
+    return ingest_data(fs, batch, destination) == -1 ? -1 : result;
+}
+
+// copy files and directory trees into the directory fs_path as one operation - inodes and data blocks of the whole batch are
+// taken before any data is copied, so the files are laid out one after another
+int copy_files_to_fs(FS* fs, char** paths, int count, char* fs_path) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    struct stat info;
+    if (count == 1 && stat(paths[0], &info) == 0 && S_ISREG(info.st_mode)) {
+        return copy_file_to_fs(fs, paths[0], fs_path); // may also name the copy
+    }
+    INGEST_BATCH batch;
+    memset(&batch, 0, sizeof(INGEST_BATCH));
+    lock_metadata(fs, F_WRLCK);
+    int result = copy_files_to_fs_locked(fs, &batch, paths, count, fs_path);
+    unlock_metadata(fs);
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.entries[i].path);
+    }
+    free(batch.entries);
+    return result;
+}
+
+int copy_file_from_fs(FS* fs, char* file_path, char* output_path) {
+    return copy_files_from_fs(fs, &file_path, 1, output_path);
+}
+
+// create output_path for inode_index and queue its data, a directory is created with everything below it
+static int export_tree(FS* fs, TRANSFER_QUEUE* queue, int inode_index, char* output_path) {
+    if (fs->inodes[inode_index].type == TYPE_FILE) {
+        int fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            printf("Error: could not open file %s.\n", output_path);
+            return -1;
+        }
+        close(fd);
+        queue_file(queue, inode_index, output_path, fs->inodes[inode_index].size, 0, inode_index);
+        return 0;
+    }
+    if (mkdir(output_path, 0755) == -1 && errno != EEXIST) {
+        printf("Error: could not create directory %s.\n", output_path);
+        return -1;
+    }
+    int result = 0;
+    DIR_NODE* node = dir_alloc_node(fs);
+    char* entry_path = (char*) malloc(strlen(output_path) + MAX_FILE_NAME + 1);
+    dir_first_leaf(fs, inode_index, node);
+    for (int leaves = 0; node->is_leaf && leaves < fs->inodes[inode_index].size / fs->superblock.block_size; leaves++) {
+        for (int i = 0; i < node->count; i++) {
+            int child = dir_entries(node)[i].inode;
+            // same checks as list_directory
+            if (child < 0 || child >= fs->superblock.total_inodes || fs->inodes[child].is_used != USED
+                || fs->inodes[child].parent != inode_index || child == fs->superblock.root_inode) {
+                continue;
+            }
+            sprintf(entry_path, "%s/%.31s", output_path, dir_entries(node)[i].name);
+            if (export_tree(fs, queue, child, entry_path) == -1) {
+                result = -1;
+            }
+        }
+        if (node->next_leaf == END_OF_FILE) {
+            break;
+        }
+        dir_read_node(fs, inode_index, node->next_leaf, node);
+    }
+    free(entry_path);
+    free(node);
+    return result;
+}
+
+// queue the copy of paths into the directory output_directory, or of a single file to the file output_directory
+static int plan_export(FS* fs, TRANSFER_QUEUE* queue, char** paths, int count, char* output_directory) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    if (count == 1) {
+        int inode_index = resolve_path(fs, paths[0], &parent, name);
+        if (inode_index >= 0 && fs->inodes[inode_index].type == TYPE_FILE) {
+            return export_tree(fs, queue, inode_index, output_directory); // may also name the copy
+        }
+    }
+    struct stat info;
+    if (stat(output_directory, &info) == -1 || !S_ISDIR(info.st_mode)) {
+        printf("Error: could not open directory %s.\n", output_directory);
+        return -1;
+    }
+    int result = 0;
+    char* output_path = (char*) malloc(strlen(output_directory) + MAX_FILE_NAME + 1);
+    for (int i = 0; i < count; i++) {
+        int inode_index = resolve_path(fs, paths[i], &parent, name);
+        if (inode_index < 0) {
+            printf("Error: file %s not found.\n", paths[i]);
+            result = -1;
+            continue;
+        }
+        // the root directory has no name, its entries go straight into output_directory
+        if (inode_index == fs->superblock.root_inode) {
+            strcpy(output_path, output_directory);
+        } else {
+            sprintf(output_path, "%s/%s", output_directory, fs->inodes[inode_index].name);
+        }
+        if (export_tree(fs, queue, inode_index, output_path) == -1) {
+            result = -1;
+        }
+    }
+    free(output_path);
+    return result;
+}
+
+// lock or unlock the files whose data is queued, returns a file another process holds a conflicting lock on or -1
+static int lock_queued_files(FS* fs, TRANSFER_QUEUE* queue, int type) {
+    for (int i = 0; i < queue->count; i++) {
+        int owner = queue->transfers[i].owner;
+        if ((i == 0 || owner != queue->transfers[i - 1].owner) && lock_inode(fs, owner, type, 0) == -1) {
+            for (int j = 0; j < i; j++) {
+                lock_inode(fs, queue->transfers[j].owner, F_UNLCK, 1);
+            }
+            return owner;
+        }
+    }
+    return -1;
+}
+
+// copy files and directory trees of the file system into the directory output_directory, with the data transfers in parallel -
+// the metadata lock is only held while the copy is planned, the files stay locked against writers until their data is copied
+int copy_files_from_fs(FS* fs, char** paths, int count, char* output_directory) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    while (1) {
+        lock_metadata(fs, F_RDLCK);
+        TRANSFER_QUEUE queue;
+        queue_init(&queue, fs);
+        int result = plan_export(fs, &queue, paths, count, output_directory);
+        int busy = lock_queued_files(fs, &queue, F_RDLCK);
+        if (busy != -1) {
+            // another process is still copying that file in, plan again once it is done
+            queue_free(&queue);
+            wait_for_inode(fs, F_RDLCK, busy);
+            continue;
+        }
+        unlock_metadata(fs);
+        if (run_transfers(&queue) == -1) {
+            // the transfers of a file are next to each other in the queue, its first failed one is reported
+            int reported = -1;
+            for (int i = 0; i < queue.count; i++) {
+                TRANSFER* transfer = &queue.transfers[i];
+                if (transfer->failed && transfer->owner != reported) {
+                    if (transfer->unreadable) {
+                        printf("Error: could not read the data of %s from the file system.\n", transfer->path);
+                    } else {
+                        printf("Error: could not write file %s.\n", transfer->path);
+                    }
+                    reported = transfer->owner;
+                }
+            }
+            result = -1;
+        }
+        lock_queued_files(fs, &queue, F_UNLCK);
+        queue_free(&queue);
+        return result;
+    }
+}
+
+// read length bytes at offset of a compressed file, decoding the frames that hold them
+static long long read_compressed(FS* fs, int inode_index, long long offset, char* buffer, long long length) {
+    char* raw = (char*) malloc(2 * COMPRESS_CHUNK);
+    STREAM stream;
+    stream_init(&stream, fs, inode_index, 1);
+    long long bytes_read = 0;
+    while (bytes_read < length) {
+        long long frame = (offset + bytes_read) / COMPRESS_CHUNK;
+        int offset_in_frame = (offset + bytes_read) % COMPRESS_CHUNK;
+        int frame_length = fs->inodes[inode_index].size - frame * COMPRESS_CHUNK < COMPRESS_CHUNK ? fs->inodes[inode_index].size - frame * COMPRESS_CHUNK : COMPRESS_CHUNK;
+        long long bounds[2]; // the table entries of the frame and of the one after it
+        stream_seek(&stream, frame * (long long) sizeof(long long));
+        if (stream_io(&stream, bounds, sizeof(bounds), 0) != (long long) sizeof(bounds)
+            || read_frame(&stream, bounds[0], bounds[1], frame_length, raw, raw + COMPRESS_CHUNK) == -1) {
+            break;
+        }
+        long long count = frame_length - offset_in_frame < length - bytes_read ? frame_length - offset_in_frame : length - bytes_read;
+        memcpy(buffer + bytes_read, raw + offset_in_frame, count);
+        bytes_read += count;
+    }
+    free(raw);
+    return bytes_read;
+}
+
+static long long read_file_at_locked(FS* fs, char* file_path, long long offset, char* buffer, long long length) {
+    int inode_index = find_file(fs, file_path);
+    if (inode_index == -1) {
+        return -1;
+    }
+    INODE* inode = &fs->inodes[inode_index];
+    EXTENT_LIST* list = &fs->extents[inode_index];
+    if (offset < 0 || offset >= inode->size) {
+        return 0;
+    }
+    if (length > inode->size - offset) {
+        length = inode->size - offset;
+    }
+    if (inode->codec != CODEC_NONE) {
+        return read_compressed(fs, inode_index, offset, buffer, length);
+    }
+    int block_size = fs->superblock.block_size;
+    long long bytes_read = 0;
+    while (bytes_read < length) {
+        // the rest of the extent holding the next byte, read ahead up to its end when the reads are sequential
+        int logical_block = (offset + bytes_read) / block_size;
+        int offset_in_block = (offset + bytes_read) % block_size;
+        int extent_index = extent_list_find(list, logical_block);
+        EXTENT* extent = &list->extents[extent_index];
+        int block_index = extent->start + logical_block - list->first_logical[extent_index];
+        long long count = (long long) (extent->start + extent->length - block_index) * block_size - offset_in_block;
+        count = count < length - bytes_read ? count : length - bytes_read;
+        if (cache_read(fs, block_offset(fs, block_index) + offset_in_block, buffer + bytes_read, count, extent->start + extent->length) != count) {
+            break;
+        }
+        bytes_read += count;
+    }
+    return bytes_read;
+}
+
+long long read_file_at(FS* fs, char* file_path, long long offset, char* buffer, long long length) {
+    if (!check_selected(fs)) {
+        return -1;
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    superblock = (SUPERBLOCK*) malloc(sizeof(SUPERBLOCK));
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    lock_metadata(fs, F_RDLCK);
+    long long result = read_file_at_locked(fs, file_path, offset, buffer, length);
+    unlock_metadata(fs);
+    return result;
+}
+
+// print the entries of a directory in name order, and the entries of its subdirectories below their own entry
+static void list_directory(FS* fs, int dir, char* path) {
+    DIR_NODE* node = dir_alloc_node(fs);
+    char* entry_path = (char*) malloc(strlen(path) + MAX_FILE_NAME + 1);
+    dir_first_leaf(fs, dir, node);
+    for (int leaves = 0; node->is_leaf && leaves < fs->inodes[dir].size / fs->superblock.block_size; leaves++) {
+        for (int i = 0; i < node->count; i++) {
+            int inode_index = dir_entries(node)[i].inode;
+            // every inode has one parent, so following only entries whose parent is this directory cannot loop
+            if (inode_index < 0 || inode_index >= fs->superblock.total_inodes || fs->inodes[inode_index].is_used != USED
+                || fs->inodes[inode_index].parent != dir || inode_index == fs->superblock.root_inode) {
+                continue;
+            }
+            sprintf(entry_path, "%s/%.31s", path, dir_entries(node)[i].name);
+            if (fs->inodes[inode_index].type == TYPE_DIRECTORY) {
+                printf("Directory: %s\n", entry_path);
+                list_directory(fs, inode_index, entry_path);
+            } else {
+                printf("File name: %-32s\t", entry_path);
+                printf("File size: %lld bytes\n", fs->inodes[inode_index].size);
+            }
+        }
+        if (node->next_leaf == END_OF_FILE) {
+            break;
+        }
+        dir_read_node(fs, dir, node->next_leaf, node);
     }
-    inodes = (INODE*) malloc(sizeof(INODE) * superblock->total_inodes);
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    data_blocks = (DATA_BLOCK*) malloc(sizeof(DATA_BLOCK) * superblock->total_data_blocks);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    fclose(fs);
+    free(entry_path);
+    free(node);
 }
 
-void copy_file_to_fs(char* fs_name, char* path_to_file) {
-    FILE* fs = fopen(fs_name, "r+");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+static int list_files_locked(FS* fs, char* directory_path) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    int dir = resolve_path(fs, directory_path, &parent, name);
+    if (dir < 0 || fs->inodes[dir].type != TYPE_DIRECTORY) {
+        printf("Error: directory not found.\n");
+        return -1;
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    // print free user space
+    printf("%lld / %lld bytes available\n", fs->superblock.user_space - fs->superblock.used_user_space, fs->superblock.user_space);
+    printf("%d / %d data blocks free\n", fs->free_blocks, fs->superblock.total_data_blocks);
+    // print file names and sizes, paths are shown from the root without trailing slashes
+    char* path = (char*) malloc(strlen(directory_path) + 2);
+    sprintf(path, "%s%s", directory_path[0] == '/' ? "" : "/", directory_path);
+    int length = strlen(path);
+    while (length > 0 && path[length - 1] == '/') {
+        path[--length] = '\0';
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    int inode_index = get_free_inode();
-    if (inode_index == -1) {
-        printf("Error: no available inodes.\n");
-        return;
+    list_directory(fs, dir, path);
+    free(path);
+    return 0;
+}
+
+int list_files(FS* fs, char* directory_path) {
+    if (!check_selected(fs)) {
+        return -1;
     }
-    // get file name from path
-    char* file_name = strrchr(path_to_file, '/');
-    if (file_name == NULL) {
-        file_name = path_to_file;
-    } else {
-        file_name++; // skip '/'
+    lock_metadata(fs, F_RDLCK);
+    int result = list_files_locked(fs, directory_path);
+    unlock_metadata(fs);
+    return result;
+}
+
+int delete_file(FS* fs, char* file_path) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    int inode_index;
+    while (1) {
+        lock_metadata(fs, F_WRLCK);
+        inode_index = find_file(fs, file_path);
+        if (inode_index == -1) {
+            unlock_metadata(fs);
+            return -1;
+        }
+        if (lock_inode(fs, inode_index, F_WRLCK, 0) == 0) {
+            break;
+        }
+        wait_for_inode(fs, F_WRLCK, inode_index); // another process is still copying the file
     }
-    if (strlen(file_name) >= MAX_FILE_NAME) {
+    remove_entry(fs, inode_index);
+    // write back only the superblock, inodes, bitmap and block table entries that changed
+    write_dirty(fs);
+    lock_inode(fs, inode_index, F_UNLCK, 1);
+    unlock_metadata(fs);
+    return 0;
+}
+
+static int make_directory_locked(FS* fs, char* directory_path) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    int target = resolve_path(fs, directory_path, &parent, name);
+    if (target == -2) {
         printf("Error: file name too long.\n");
-        return;
+        return -1;
     }
-    // check if there is already a file with the same name
-    int inode_with_name = get_inode_by_name(file_name);
-    if (inode_with_name != -1 && inodes[inode_with_name].is_used == USED) {
+    if (target >= 0) {
         printf("Error: file already exists.\n");
-        return;
+        return -1;
     }
-    // if not, set inode name to file name
-    strncpy(inodes[inode_index].name, file_name, MAX_FILE_NAME);
-    inodes[inode_index].name[MAX_FILE_NAME - 1] = '\0';
-    // open file to copy
-    FILE* file = fopen(path_to_file, "r");
-    if (file == NULL) {
-        printf("Error: could not open file.\n");
-        return;
+    if (parent == -1) {
+        printf("Error: directory not found.\n");
+        return -1;
     }
-    fseek(file, 0, SEEK_END);
-    int file_size = ftell(file);
-    if (file_size > superblock->user_space) {
-        printf("Error: file too large.\n");
-        return;
+    int inode_index = get_free_inode(fs);
+    if (inode_index == -1) {
+        printf("Error: no available inodes.\n");
+        return -1;
     }
-    fseek(file, 0, SEEK_SET);
-    inodes[inode_index].size = file_size;
-    // copy file data to data blocks
-    int current_block = -1;
-    int previous_block = -1;
-    int bytes_read = 0;
-    int bytes_left = file_size;
-    while (bytes_read < file_size) {
-        for (int i = 0; i < superblock->total_data_blocks; i++) {
-            if (data_blocks[i].is_used == NOT_USED) {
-                if (current_block == -1) {
-                    inodes[inode_index].first_block = i; // set first block
-                }
-                current_block = i;
-                break;
+    if (create_directory(fs, inode_index, parent, name) == -1) {
+        printf("Error: no available data blocks.\n");
+        return -1;
+    }
+    if (dir_insert(fs, parent, name, inode_index) == -1) {
+        printf("Error: no available data blocks.\n");
+        release_inode(fs, inode_index);
+        return -1;
+    }
+    fs->inodes[inode_index].is_used = USED;
+    index_add(fs, inode_index);
+    write_dirty(fs);
+    return 0;
+}
+
+int make_directory(FS* fs, char* directory_path) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    lock_metadata(fs, F_WRLCK);
+    int result = make_directory_locked(fs, directory_path);
+    unlock_metadata(fs);
+    return result;
+}
+
+static int remove_directory_locked(FS* fs, char* directory_path) {
+    int parent;
+    char name[MAX_FILE_NAME];
+    int inode_index = resolve_path(fs, directory_path, &parent, name);
+    if (inode_index < 0 || fs->inodes[inode_index].type != TYPE_DIRECTORY) {
+        printf("Error: directory not found.\n");
+        return -1;
+    }
+    if (inode_index == fs->superblock.root_inode) {
+        printf("Error: the root directory cannot be removed.\n");
+        return -1;
+    }
+    if (!dir_is_empty(fs, inode_index)) {
+        printf("Error: directory is not empty.\n");
+        return -1;
+    }
+    remove_entry(fs, inode_index);
+    write_dirty(fs);
+    return 0;
+}
+
+int remove_directory(FS* fs, char* directory_path) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    lock_metadata(fs, F_WRLCK);
+    int result = remove_directory_locked(fs, directory_path);
+    unlock_metadata(fs);
+    return result;
+}
+
+// where every used data block belongs and which file block it holds, while defragment_fs runs
+typedef struct defrag_state {
+    int* source; // block that belongs at each slot of the layout, or the slot itself once it is in place
+    int* origin; // block each block held when the pass started
+    int* location; // block the data of each block is at now, files sharing a block follow it together
+    int moved;
+    char* buffer; // one block, for moves that go through the journal
+} DEFRAG_STATE;
+
+static int compare_long_longs(const void* a, const void* b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+// move the data block at from to the free block at to and record its new place
+static void defrag_move(FS* fs, DEFRAG_STATE* state, int from, int to) {
+    if (journal_enabled(fs)) {
+        // logged like metadata, so the block stays at its old place too until the pass is committed
+        meta_read(fs, block_offset(fs, from), state->buffer, fs->superblock.block_size);
+        meta_write(fs, block_offset(fs, to), state->buffer, fs->superblock.block_size);
+    } else if (fs->map != NULL) {
+        memcpy(fs->map + block_offset(fs, to), fs->map + block_offset(fs, from), fs->superblock.block_size);
+    } else {
+        copy_range(fs->fd, block_offset(fs, from), fs->fd, block_offset(fs, to), fs->superblock.block_size, 0);
+    }
+    set_block_used(fs, to);
+    fs->blocks[to] = fs->blocks[from]; // references and checksum go with the data
+    set_block_free(fs, from);
+    state->origin[to] = state->origin[from];
+    state->location[state->origin[to]] = to;
+    state->moved++;
+}
+
+// fill the free layout slot and then every slot vacated on the way, until a block comes from outside the layout or the limit is hit
+static void defrag_chain(FS* fs, DEFRAG_STATE* state, int slot, int layout_size, int max_blocks) {
+    while (slot < layout_size && state->source[slot] != slot && state->moved < max_blocks) {
+        int block_index = state->source[slot];
+        defrag_move(fs, state, block_index, slot);
+        state->source[slot] = slot;
+        slot = block_index;
+    }
+}
+
+// moves a pass can make with the extents of every file still fitting the free blocks afterwards, -1 if not even max_blocks
+// fit - a file has no more extents than blocks, and a move splits at most one extent of every file that holds the block
+static int defrag_move_limit(FS* fs, int max_blocks) {
+    long long extent_blocks = 0; // extent blocks the files hold now, released at the start of the pass
+    long long worst_blocks = 0; // extent blocks with every data block an extent of its own
+    for (int i = 0; i < fs->superblock.total_inodes; i++) {
+        if (fs->inodes[i].is_used == USED) {
+            EXTENT_LIST* list = &fs->extents[i];
+            long long file_blocks = 0;
+            for (int j = 0; j < list->count; j++) {
+                file_blocks += list->extents[j].length;
             }
+            extent_blocks += extent_blocks_for(fs, list->count);
+            worst_blocks += extent_blocks_for(fs, file_blocks);
         }
-        if (current_block == -1) {
-            printf("Error: no available data blocks.\n");
-            return;
-        }
-        if (previous_block != -1) {
-            data_blocks[previous_block].next_block = current_block; // set next block value of previous block
+    }
+    if (worst_blocks <= fs->free_blocks + extent_blocks) {
+        return INT_MAX;
+    }
+    int max_refs = 1;
+    for (int i = 0; i < fs->superblock.total_data_blocks; i++) {
+        if (fs->blocks[i].extra_refs + 1 > max_refs) {
+            max_refs = fs->blocks[i].extra_refs + 1;
         }
-        data_blocks[current_block].is_used = USED;
-        data_blocks[current_block].next_block = END_OF_FILE;
-        if (bytes_left > BLOCK_SIZE) {
-            // if there are more bytes to read than the block size, read a block only
-            fread(data_blocks[current_block].data, BLOCK_SIZE, 1, file);
-            bytes_read += BLOCK_SIZE;
-            bytes_left -= BLOCK_SIZE;
-        } else {
-            // otherwise, read the remaining bytes
-            fread(data_blocks[current_block].data, bytes_left, 1, file);
-            bytes_read += bytes_left;
-            bytes_left = 0;
-        }
-        previous_block = current_block;
-    }
-    inodes[inode_index].is_used = USED; // set inode as used
-    superblock->used_user_space += file_size; // update used user space
-    // update superblock, inodes, and data blocks in file
-    fseek(fs, 0, SEEK_SET);
-    fwrite(superblock, sizeof(SUPERBLOCK), 1, fs);
-    fseek(fs, INODES_OFFSET, SEEK_SET);
-    fwrite(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fseek(fs, DATA_OFFSET, SEEK_SET);
-    fwrite(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    fclose(file);
-    fclose(fs);
+    }
+    return 2LL * max_blocks * max_refs > fs->free_blocks ? -1 : max_blocks;
 }
 
-void copy_file_from_fs(char* fs_name, char* file_name, char* output_path) {
-    FILE* fs = fopen(fs_name, "r");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+// move up to max_blocks blocks towards the layout, returns the number of blocks moved and sets blocks_left
+static int defrag_pass(FS* fs, int max_blocks, int* blocks_left) {
+    int total_blocks = fs->superblock.total_data_blocks;
+    int total_inodes = fs->superblock.total_inodes;
+    int* order = (int*) malloc(sizeof(int) * total_inodes);
+    char* in_order = (char*) calloc(total_inodes, sizeof(char));
+    int move_limit = defrag_move_limit(fs, max_blocks);
+    if (move_limit == -1) {
+        printf("Error: not enough free data blocks for the extents of the moved files, defragment fewer blocks at a time or free some space.\n");
+        free(order);
+        free(in_order);
+        *blocks_left = 0;
+        return -1;
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    // extent blocks are written again once the data blocks are in place
+    for (int i = 0; i < total_inodes; i++) {
+        if (fs->inodes[i].is_used == USED) {
+            release_extent_blocks(fs, &fs->inodes[i]);
+        }
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    int inode_index = get_inode_by_name(file_name);
-    if (inode_index == -1) {
-        printf("Error: file not found.\n");
-        return;
+    // files keep their place in the layout between incremental calls, files that are new to the pass go after them in disk order
+    int order_count = 0;
+    for (int i = 0; i < fs->defrag_count; i++) {
+        int inode_index = fs->defrag_order[i];
+        if (fs->inodes[inode_index].is_used == USED && fs->extents[inode_index].count > 0) {
+            order[order_count++] = inode_index;
+            in_order[inode_index] = 1;
+        }
     }
-    FILE* file = fopen(output_path, "w");
-    if (file == NULL) {
-        printf("Error: could not open file.\n");
-        return;
+    long long* new_files = (long long*) malloc(sizeof(long long) * total_inodes);
+    int new_count = 0;
+    for (int i = 0; i < total_inodes; i++) {
+        if (fs->inodes[i].is_used == USED && fs->extents[i].count > 0 && !in_order[i]) {
+            new_files[new_count++] = (long long) fs->extents[i].extents[0].start * total_inodes + i;
+        }
+    }
+    qsort(new_files, new_count, sizeof(long long), compare_long_longs);
+    for (int i = 0; i < new_count; i++) {
+        order[order_count++] = new_files[i] % total_inodes;
+    }
+    free(new_files);
+    free(in_order);
+    free(fs->defrag_order);
+    fs->defrag_order = order;
+    fs->defrag_count = order_count;
+    // every file gets a contiguous run of the layout, in order from the first block
+    // a block shared by several files is laid out with the first of them
+    DEFRAG_STATE state;
+    state.source = (int*) malloc(sizeof(int) * total_blocks);
+    state.origin = (int*) malloc(sizeof(int) * total_blocks);
+    state.location = (int*) malloc(sizeof(int) * total_blocks);
+    state.moved = 0;
+    state.buffer = (char*) malloc(fs->superblock.block_size);
+    for (int i = 0; i < total_blocks; i++) {
+        state.origin[i] = i;
+        state.location[i] = -1;
     }
-    int current_block = inodes[inode_index].first_block; // get first block
-    int bytes_left = inodes[inode_index].size;
-    while (bytes_left > 0) {
-        int bytes_to_write = bytes_left < BLOCK_SIZE ? bytes_left : BLOCK_SIZE; // write a block or the remaining bytes if less than a block
-        fwrite(data_blocks[current_block].data, bytes_to_write, 1, file); // write data block to destination file
-        bytes_left -= bytes_to_write;
-        if (bytes_left > 0) {
-            current_block = data_blocks[current_block].next_block; // get next block if there are still bytes left
-            if (current_block == -1) {
-                printf("Error: file data is corrupted.\n");
-                return;
+    int layout_size = 0;
+    for (int i = 0; i < order_count; i++) {
+        EXTENT_LIST* list = &fs->extents[order[i]];
+        for (int j = 0; j < list->count; j++) {
+            for (int k = list->extents[j].start; k < list->extents[j].start + list->extents[j].length; k++) {
+                if (state.location[k] == -1) {
+                    state.location[k] = k;
+                    state.source[layout_size++] = k;
+                }
             }
         }
     }
-    fclose(file);
-    fclose(fs);
-}
-
-void list_files(char* fs_name) {
-    FILE* fs = fopen(fs_name, "r");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+    // chains - a free slot of the layout takes its block, whose old place is the next slot to fill
+    for (int i = find_block(fs, 0, 0); i < layout_size && state.moved < max_blocks; i = find_block(fs, i + 1, 0)) {
+        defrag_chain(fs, &state, i, layout_size, max_blocks);
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    // cycles - the layout holds only blocks that belong elsewhere in it, one of them is moved out of the way to start a chain
+    for (int i = 0; i < layout_size && state.moved < max_blocks; i++) {
+        if (state.source[i] == i) {
+            continue;
+        }
+        int last = i; // slot the block at i belongs to
+        int cycle_length = 1;
+        while (state.source[last] != i) {
+            last = state.source[last];
+            cycle_length++;
+        }
+        int spare = find_block(fs, layout_size, 0);
+        if (spare < total_blocks) {
+            defrag_move(fs, &state, i, spare);
+            state.source[last] = spare;
+            defrag_chain(fs, &state, i, layout_size, max_blocks);
+            continue;
+        }
+        // no free block at all, rotate the whole cycle through a buffer even if that goes past max_blocks - it is one commit,
+        // a cycle the journal cannot hold stays where it is
+        if (journal_enabled(fs) && cycle_length > journal_block_budget(fs)) {
+            continue;
+        }
+        if (state.moved + cycle_length > move_limit) {
+            continue;
+        }
+        char* held = (char*) malloc(fs->superblock.block_size);
+        char* data = (char*) malloc(fs->superblock.block_size);
+        meta_read(fs, block_offset(fs, i), held, fs->superblock.block_size);
+        int held_origin = state.origin[i];
+        BLOCK_META held_meta = fs->blocks[i];
+        for (int slot = i; slot != last;) {
+            int block_index = state.source[slot];
+            meta_read(fs, block_offset(fs, block_index), data, fs->superblock.block_size);
+            meta_write(fs, block_offset(fs, slot), data, fs->superblock.block_size);
+            cache_drop(fs, slot);
+            fs->blocks[slot] = fs->blocks[block_index];
+            mark_block_dirty(fs, slot);
+            state.origin[slot] = state.origin[block_index];
+            state.location[state.origin[slot]] = slot;
+            state.source[slot] = slot;
+            state.moved++;
+            slot = block_index;
+        }
+        meta_write(fs, block_offset(fs, last), held, fs->superblock.block_size);
+        cache_drop(fs, last);
+        fs->blocks[last] = held_meta;
+        mark_block_dirty(fs, last);
+        state.origin[last] = held_origin;
+        state.location[held_origin] = last;
+        state.source[last] = last;
+        state.moved++;
+        // the rotated data is only in the journal until it is committed, reads of the disk file would get the old blocks
+        fs->journal.blocks_freed = 1;
+        free(held);
+        free(data);
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    // print free user space
-    printf("%d / %d bytes available\n", superblock->user_space - superblock->used_user_space, superblock->user_space);
-    // print file names and sizes
-    for (int i = 0; i < superblock->total_inodes; i++) {
-        if (inodes[i].is_used == USED) {
-            printf("File name: %-32.32s\t", inodes[i].name);
-            printf("File size: %d bytes\n", inodes[i].size);
+    *blocks_left = 0;
+    for (int i = 0; i < layout_size; i++) {
+        *blocks_left += state.source[i] != i;
+    }
+    // rebuild the extents of every file from the new places of its blocks
+    EXTENT_LIST moved;
+    memset(&moved, 0, sizeof(EXTENT_LIST));
+    int result = state.moved;
+    for (int i = 0; i < order_count; i++) {
+        int inode_index = order[i];
+        EXTENT_LIST* list = &fs->extents[inode_index];
+        moved.count = 0;
+        for (int j = 0; j < list->count; j++) {
+            for (int k = list->extents[j].start; k < list->extents[j].start + list->extents[j].length; k++) {
+                extent_list_append(&moved, state.location[k], 1);
+            }
+        }
+        EXTENT_LIST old = *list;
+        *list = moved;
+        moved = old;
+        if (store_extents(fs, inode_index) == -1) {
+            // cannot happen after the check above, the rest of the files are still stored so only this one is lost
+            printf("Error: no available data blocks for the extents of %s.\n", fs->inodes[inode_index].name);
+            result = -1;
         }
     }
-    fclose(fs);
+    free(moved.extents);
+    free(moved.first_logical);
+    if (fs->dedup_buckets != NULL) {
+        build_dedup_index(fs); // checksums moved with their blocks
+    }
+    if (*blocks_left == 0) {
+        // pass finished, the next call plans a new layout
+        free(fs->defrag_order);
+        fs->defrag_order = NULL;
+        fs->defrag_count = 0;
+    }
+    free(state.source);
+    free(state.origin);
+    free(state.location);
+    free(state.buffer);
+    return result;
 }
 
-void delete_file(char* fs_name, char* file_name) {
-    FILE* fs = fopen(fs_name, "r+");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+int defragment_fs(FS* fs, int max_blocks) {
+    if (!check_selected(fs)) {
+        return -1;
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (max_blocks <= 0) {
+        max_blocks = INT_MAX;
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    int inode_index = get_inode_by_name(file_name);
-    if (inode_index == -1) {
-        printf("Error: file not found.\n");
-        return;
+    // with the journal every moved block is logged, a pass moves no more than half of the journal holds
+    int pass_blocks = max_blocks;
+    if (journal_enabled(fs)) {
+        pass_blocks = journal_block_budget(fs) < max_blocks ? journal_block_budget(fs) : max_blocks;
     }
-    int current_block = inodes[inode_index].first_block; // get first block
-    // free data blocks by setting them as not used
-    while (current_block != END_OF_FILE) {
-        data_blocks[current_block].is_used = NOT_USED;
-        current_block = data_blocks[current_block].next_block;
-    }
-    inodes[inode_index].is_used = NOT_USED; // set inode as not used
-    superblock->used_user_space -= inodes[inode_index].size; // update used user space
-    // update superblock, inodes, and data blocks in file
-    fseek(fs, 0, SEEK_SET);
-    fwrite(superblock, sizeof(SUPERBLOCK), 1, fs);
-    fseek(fs, INODES_OFFSET, SEEK_SET);
-    fwrite(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fseek(fs, DATA_OFFSET, SEEK_SET);
-    fwrite(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    fclose(fs);
-}
-
-void defragment_fs(char* fs_name) {
-    FILE* fs = fopen(fs_name, "r+");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+    // every file may have blocks moved, so none may be copied by another process meanwhile
+    while (1) {
+        lock_metadata(fs, F_WRLCK);
+        if (lock_inode(fs, -1, F_WRLCK, 0) == 0) {
+            break;
+        }
+        wait_for_inode(fs, F_WRLCK, -1);
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    int moved = 0;
+    int blocks_left = 0;
+    do {
+        int count = defrag_pass(fs, pass_blocks < max_blocks - moved ? pass_blocks : max_blocks - moved, &blocks_left);
+        // write back only the superblock, inodes, bitmap and block table entries that changed
+        write_dirty(fs);
+        if (count == -1) {
+            lock_inode(fs, -1, F_UNLCK, 1);
+            unlock_metadata(fs);
+            return -1;
+        }
+        moved += count;
+        if (count == 0) {
+            break;
+        }
+    } while (blocks_left > 0 && moved < max_blocks);
+    lock_inode(fs, -1, F_UNLCK, 1);
+    unlock_metadata(fs);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    printf("Moved %d blocks in %.3f s", moved, seconds);
+    if (blocks_left > 0) {
+        printf(", %d blocks left to move", blocks_left);
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    // defragment data blocks - move used blocks to the beginning 
-    for (int i = 0; i < superblock->total_data_blocks; i++) {
-        if (data_blocks[i].is_used == NOT_USED) {
-            for (int j = i + 1; j < superblock->total_data_blocks; j++) {
-                if (data_blocks[j].is_used == USED) {
-                    // find the inode that uses this data block
-                    for (int k = 0; k < superblock->total_inodes; k++) {
-                        if (inodes[k].first_block == j) {
-                            // update the inode to point to the new data block
-                            inodes[k].first_block = i;
-                            break;
-                        }
-                    }
-                    // copy data from used block to free block
-                    memcpy(data_blocks[i].data, data_blocks[j].data, BLOCK_SIZE);
-                    data_blocks[i].is_used = USED;
-                    data_blocks[j].is_used = NOT_USED;
-                    // update next_block values
-                    if (data_blocks[j].next_block != END_OF_FILE) {
-                        data_blocks[i].next_block = i + 1;
-                    } else {
-                        data_blocks[i].next_block = END_OF_FILE;
-                    }
-                    // find the data block that points to j and update it to point to i
-                    for (int k = 0; k < superblock->total_data_blocks; k++) {
-                        if (data_blocks[k].next_block == j) {
-                            data_blocks[k].next_block = i;
-                            break;
-                        }
-                    }
-                    data_blocks[j].next_block = END_OF_FILE;
-                    break;
-                }
+    printf("\n");
+    return 0;
+}
+
+// runs of data blocks scrub_fs checks, each block once however many files share it
+typedef struct scrub_range {
+    int start;
+    int length;
+    int inode;
+} SCRUB_RANGE;
+
+typedef struct scrub_state {
+    FS* fs;
+    SCRUB_RANGE* ranges;
+    int count;
+    int next; // next range to check, taken by the workers with an atomic increment
+    long long checked;
+    long long unchecked; // blocks written before the blocks got checksums
+    int* damaged; // damaged blocks and the inodes of their files, in pairs
+    int damaged_count;
+    int damaged_capacity;
+    pthread_mutex_t lock; // guards damaged
+} SCRUB_STATE;
+
+static void* scrub_worker(void* argument) {
+    SCRUB_STATE* state = (SCRUB_STATE*) argument;
+    FS* fs = state->fs;
+    int block_size = fs->superblock.block_size;
+    char* buffer = fs->map == NULL ? (char*) malloc(IO_SIZE) : NULL;
+    unsigned int* checksums = (unsigned int*) malloc(sizeof(unsigned int) * fs->io_blocks);
+    long long checked = 0;
+    long long unchecked = 0;
+    for (int i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED); i < state->count; i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) {
+        SCRUB_RANGE* range = &state->ranges[i];
+        char* data = fs->map != NULL ? fs->map + block_offset(fs, range->start) : buffer;
+        long long bytes = (long long) range->length * block_size;
+        int readable = fs->map != NULL || pread_all(fs->fd, data, bytes, block_offset(fs, range->start)) == bytes;
+        if (readable) {
+            checksum_blocks(fs, data, range->length, checksums);
+        }
+        for (int j = 0; j < range->length; j++) {
+            unsigned int expected = fs->blocks[range->start + j].checksum;
+            if (readable && expected == 0) {
+                unchecked++;
+                continue;
+            }
+            checked++;
+            if (readable && expected == checksums[j]) {
+                continue;
             }
+            count_stat(&stats.checksum_errors, 1);
+            pthread_mutex_lock(&state->lock);
+            if (state->damaged_count == state->damaged_capacity) {
+                state->damaged_capacity = state->damaged_capacity == 0 ? 16 : state->damaged_capacity * 2;
+                state->damaged = (int*) realloc(state->damaged, sizeof(int) * 2 * state->damaged_capacity);
+            }
+            state->damaged[2 * state->damaged_count] = range->start + j;
+            state->damaged[2 * state->damaged_count + 1] = range->inode;
+            state->damaged_count++;
+            pthread_mutex_unlock(&state->lock);
         }
     }
-    // update superblock, inodes, and data blocks in file
-    fseek(fs, 0, SEEK_SET);
-    fwrite(superblock, sizeof(SUPERBLOCK), 1, fs);
-    fseek(fs, INODES_OFFSET, SEEK_SET);
-    fwrite(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fseek(fs, DATA_OFFSET, SEEK_SET);
-    fwrite(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
-    fclose(fs);
+    __atomic_fetch_add(&state->checked, checked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->unchecked, unchecked, __ATOMIC_RELAXED);
+    free(checksums);
+    free(buffer);
+    return NULL;
 }
 
-void delete_fs(char* fs_name) {
-    FILE* fs = fopen(fs_name, "r");
-    if (fs == NULL) {
-        printf("Error: could not open disk file.\n");
-        return;
+// read every data block of every file and compare it with its checksum, on up to fs->threads threads - returns -1 if any is damaged
+int scrub_fs(FS* fs) {
+    if (!check_selected(fs)) {
+        return -1;
     }
-    // load superblock into memory to check if it is a file system
-    fseek(fs, 0, SEEK_SET);
-    superblock = (SUPERBLOCK*) malloc(sizeof(SUPERBLOCK));
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
-        printf("Error: file is not a file system.\n");
-        return;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    lock_metadata(fs, F_RDLCK); // files copied in meanwhile get their checksums once this is done
+    SCRUB_STATE state;
+    memset(&state, 0, sizeof(SCRUB_STATE));
+    state.fs = fs;
+    pthread_mutex_init(&state.lock, NULL);
+    int capacity = 64;
+    state.ranges = (SCRUB_RANGE*) malloc(sizeof(SCRUB_RANGE) * capacity);
+    unsigned long long* seen = (unsigned long long*) calloc(fs->map_words, sizeof(unsigned long long));
+    for (int i = 0; i < fs->superblock.total_inodes; i++) {
+        if (fs->inodes[i].is_used != USED || fs->inodes[i].type != TYPE_FILE) {
+            continue;
+        }
+        EXTENT_LIST* list = &fs->extents[i];
+        for (int j = 0; j < list->count; j++) {
+            for (int block_index = list->extents[j].start; block_index < list->extents[j].start + list->extents[j].length; block_index++) {
+                if (seen[block_index / 64] >> (block_index % 64) & 1) {
+                    continue;
+                }
+                seen[block_index / 64] |= 1ULL << (block_index % 64);
+                SCRUB_RANGE* last = state.count > 0 ? &state.ranges[state.count - 1] : NULL;
+                if (last != NULL && last->inode == i && last->start + last->length == block_index && last->length < fs->io_blocks) {
+                    last->length++;
+                    continue;
+                }
+                if (state.count == capacity) {
+                    capacity *= 2;
+                    state.ranges = (SCRUB_RANGE*) realloc(state.ranges, sizeof(SCRUB_RANGE) * capacity);
+                }
+                state.ranges[state.count].start = block_index;
+                state.ranges[state.count].length = 1;
+                state.ranges[state.count].inode = i;
+                state.count++;
+            }
+        }
     }
-    fclose(fs);
-    remove(fs_name);
+    free(seen);
+    int threads = fs->threads < state.count ? fs->threads : state.count;
+    pthread_t workers[MAX_THREADS];
+    int started_threads = 0;
+    while (started_threads < threads - 1 && pthread_create(&workers[started_threads], NULL, scrub_worker, &state) == 0) {
+        started_threads++;
+    }
+    scrub_worker(&state);
+    for (int i = 0; i < started_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    qsort(state.damaged, state.damaged_count, 2 * sizeof(int), compare_ints); // pairs in block order
+    for (int i = 0; i < state.damaged_count; i++) {
+        printf("Error: data block %d of file %s is corrupted.\n", state.damaged[2 * i], fs->inodes[state.damaged[2 * i + 1]].name);
+    }
+    unlock_metadata(fs);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    long long blocks = state.checked + state.unchecked;
+    printf("Scrubbed %lld blocks in %.3f s, %.1f MiB/s", blocks, seconds,
+           seconds > 0 ? blocks * (double) fs->superblock.block_size / (1 << 20) / seconds : 0.0);
+    if (state.unchecked > 0) {
+        printf(", %lld blocks without a checksum", state.unchecked);
+    }
+    printf(", %d damaged\n", state.damaged_count);
+    int result = state.damaged_count > 0 ? -1 : 0;
+    free(state.ranges);
+    free(state.damaged);
+    pthread_mutex_destroy(&state.lock);
+    return result;
 }
 
-void usage_map(char* fs_name) {
-    FILE* fs = fopen(fs_name, "r");
-    if (fs == NULL) {
+int delete_fs(char* fs_name) {
+    FILE* file = fopen(fs_name, "r");
+    if (file == NULL) {
         printf("Error: could not open disk file.\n");
-        return;
+        return -1;
     }
-    // load superblock, inodes, and data blocks into memory
-    fseek(fs, 0, SEEK_SET);
-    fread(superblock, sizeof(SUPERBLOCK), 1, fs);
-    if (superblock->magic_number != MAGIC_NUMBER) {
+    // load magic number to check if it is a file system
+    int magic_number = 0;
+    fread(&magic_number, sizeof(int), 1, file);
+    fclose(file);
+    if (magic_number != MAGIC_NUMBER && magic_number != EXTENT_MAGIC_NUMBER && magic_number != LEGACY_MAGIC_NUMBER) {
         printf("Error: file is not a file system.\n");
-        return;
+        return -1;
     }
-    fread(inodes, sizeof(INODE), superblock->total_inodes, fs);
-    fread(data_blocks, sizeof(DATA_BLOCK), superblock->total_data_blocks, fs);
+    remove(fs_name);
+    return 0;
+}
+
+static int usage_map_locked(FS* fs) {
+    SUPERBLOCK* superblock = &fs->superblock;
     // get superblock info
     printf("Superblock:\n");
-    printf("Total size: %d bytes\n", superblock->total_size);
+    printf("Total size: %lld bytes\n", superblock->total_size);
+    struct stat status;
+    if (fstat(fs->fd, &status) == 0) {
+        printf("Stored on the host: %lld bytes\n", (long long) status.st_blocks * 512); // the rest of the disk file is holes
+    }
     printf("Total inodes: %d\n", superblock->total_inodes);
     printf("Total data blocks: %d\n", superblock->total_data_blocks);
-    printf("User space: %d bytes\n", superblock->user_space);
-    printf("Used user space: %d bytes\n", superblock->used_user_space);
+    printf("User space: %lld bytes\n", superblock->user_space);
+    printf("Used user space: %lld bytes\n", superblock->used_user_space);
     printf("Block size: %d bytes\n", superblock->block_size);
+    printf("Backend: %s\n", fs->map != NULL ? "mmap" : "file");
+    printf("Free data blocks: %d\n", fs->free_blocks);
+    printf("Bitmap offset: %lld\n", superblock->bitmap_offset);
+    printf("Block table offset: %lld\n", superblock->block_table_offset);
+    printf("Inodes offset: %lld\n", superblock->inodes_offset);
+    printf("Journal offset: %lld\n", superblock->journal_offset);
+    printf("Journal size: %lld bytes\n", superblock->journal_size);
+    printf("Data offset: %lld\n", superblock->data_offset);
+    printf("Root directory inode: %d\n", superblock->root_inode);
+    printf("Block cache: %d blocks, %lld hits, %lld misses, %lld blocks read ahead\n", fs->cache.slot_count, fs->cache.hits, fs->cache.misses, fs->cache.read_ahead);
+    long long raw_size = 0;
+    long long stored_size = 0;
+    for (int i = 0; i < superblock->total_inodes; i++) {
+        if (fs->inodes[i].is_used == USED && fs->inodes[i].type == TYPE_FILE) {
+            raw_size += fs->inodes[i].size;
+            stored_size += stored_bytes(&fs->inodes[i]);
+        }
+    }
+    printf("Compression: %lld bytes of files stored in %lld bytes, ratio %.2f\n", raw_size, stored_size, stored_size > 0 ? (double) raw_size / stored_size : 1.0);
+    long long shared_blocks = 0;
+    long long saved_blocks = 0;
+    for (int i = 0; i < superblock->total_data_blocks; i++) {
+        shared_blocks += fs->blocks[i].extra_refs > 0;
+        saved_blocks += fs->blocks[i].extra_refs;
+    }
+    printf("Deduplication: %lld blocks shared, %lld bytes saved\n", shared_blocks, saved_blocks * superblock->block_size);
     printf("\n");
     // get inodes info
     printf("Inodes:\n");
     for (int i = 0; i < superblock->total_inodes; i++) {
         printf("\tInode %d:\n", i);
-        printf("\t\tName: %-32.32s\t", inodes[i].name);
-        printf("\t\tSize: %-6.6d bytes\t", inodes[i].size);
-        printf("\t\tFirst block: %2.2d\t", inodes[i].first_block);
-        printf("\t\tUsed: %s\n", inodes[i].is_used ? "yes" : "no");
+        printf("\t\tName: %-32.32s\t", fs->inodes[i].name);
+        printf("\t\tSize: %-6.6lld bytes\t", fs->inodes[i].size);
+        printf("\t\tUsed: %s\n", fs->inodes[i].is_used ? "yes" : "no");
+        if (fs->inodes[i].is_used == USED) {
+            printf("\t\tType: %s\t\tParent: %d\n", fs->inodes[i].type == TYPE_DIRECTORY ? "directory" : "file", fs->inodes[i].parent);
+            if (fs->inodes[i].codec != CODEC_NONE) {
+                printf("\t\tCompression: %s, %lld bytes stored, ratio %.2f\n", fs->inodes[i].codec == CODEC_HIGH ? "high" : "fast", fs->inodes[i].stored_size,
+                       fs->inodes[i].stored_size > 0 ? (double) fs->inodes[i].size / fs->inodes[i].stored_size : 1.0);
+            }
+            printf("\t\tExtents:");
+            for (int j = 0; j < fs->extents[i].count; j++) {
+                printf(" %d-%d", fs->extents[i].extents[j].start, fs->extents[i].extents[j].start + fs->extents[i].extents[j].length - 1);
+            }
+            printf("\n");
+        }
     }
     printf("\n");
     // get data blocks info
     printf("Data blocks:\n");
     for (int i = 0; i < superblock->total_data_blocks; i++) {
         printf("\tData block %d:\n", i);
-        printf("\t\tUsed: %s\t", data_blocks[i].is_used ? "yes" : "no");
-        printf("\t\tNext block: %2.2d\n", data_blocks[i].next_block);
+        printf("\t\tUsed: %s\t", block_is_used(fs, i) ? "yes" : "no");
+        printf("\t\tNext block: %2.2d", fs->blocks[i].next_block);
+        if (fs->blocks[i].extra_refs > 0) {
+            printf("\t\tShared by: %d files", fs->blocks[i].extra_refs + 1);
+        }
+        printf("\n");
     }
-    fclose(fs);
+    return 0;
 }
 
-int get_free_inode() {
-    for (int i = 0; i < superblock->total_inodes; i++) {
-        if (inodes[i].is_used == NOT_USED) {
-            return i;
+int usage_map(FS* fs) {
+    if (!check_selected(fs)) {
+        return -1;
+    }
+    lock_metadata(fs, F_RDLCK);
+    int result = usage_map_locked(fs);
+    unlock_metadata(fs);
+    return result;
+}
+
+// add the time a command took to its timings, the commands without a slot left are not recorded
+void record_command(char* name, long long nanoseconds) {
+    COMMAND_STATS* command = NULL;
+    for (int i = 0; i < stats.command_count && command == NULL; i++) {
+        command = strcmp(stats.commands[i].name, name) == 0 ? &stats.commands[i] : NULL;
+    }
+    if (command == NULL) {
+        if (stats.command_count == MAX_STAT_COMMANDS) {
+            return;
         }
+        command = &stats.commands[stats.command_count++];
+        snprintf(command->name, MAX_FILE_NAME, "%s", name);
     }
-    return -1;
+    int bucket = nanoseconds > 0 ? 63 - __builtin_clzll(nanoseconds) : 0;
+    command->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    command->count++;
+    command->total_nanoseconds += nanoseconds;
+    command->max_nanoseconds = nanoseconds > command->max_nanoseconds ? nanoseconds : command->max_nanoseconds;
 }
 
-int get_inode_by_name(char* file_name) {
-    for (int i = 0; i < superblock->total_inodes; i++) {
-        if (strcmp(inodes[i].name, file_name) == 0) {
+void reset_stats(void) {
+    memset(&stats, 0, sizeof(FS_STATS));
+}
+
+// upper bound of the timing bucket holding the given fraction of a command's runs, in milliseconds
+static double command_percentile(COMMAND_STATS* command, double fraction) {
+    long long rank = (long long) (fraction * command->count + 0.999999);
+    long long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += command->buckets[i];
+        if (seen >= rank) {
+            long long bound = i < 62 ? 2LL << i : LLONG_MAX;
+            return (bound < command->max_nanoseconds ? bound : command->max_nanoseconds) / 1e6;
+        }
+    }
+    return command->max_nanoseconds / 1e6;
+}
+
+// write the counters, the block cache of the selected file system and the command timings as one JSON object
+int print_stats(FS* fs) {
+    long long* counters[] = {&stats.read_calls, &stats.bytes_read, &stats.write_calls, &stats.bytes_written, &stats.copy_calls,
+                             &stats.bytes_copied, &stats.sync_calls, &stats.punch_calls, &stats.blocks_scanned, &stats.blocks_allocated,
+                             &stats.blocks_freed, &stats.blocks_shared, &stats.bytes_checksummed, &stats.checksum_errors,
+                             &stats.journal_commits, &stats.journal_bytes, &stats.metadata_reloads};
+    const char* names[] = {"read_calls", "bytes_read", "write_calls", "bytes_written", "copy_calls", "bytes_copied", "sync_calls",
+                           "punch_calls", "blocks_scanned", "blocks_allocated", "blocks_freed", "blocks_shared", "bytes_checksummed",
+                           "checksum_errors", "journal_commits", "journal_bytes", "metadata_reloads"};
+    printf("{\"counters\": {");
+    for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        printf("%s\"%s\": %lld", i > 0 ? ", " : "", names[i], __atomic_load_n(counters[i], __ATOMIC_RELAXED));
+    }
+    printf("}, \"cache\": ");
+    if (fs != NULL) {
+        printf("{\"blocks\": %d, \"hits\": %lld, \"misses\": %lld, \"read_ahead\": %lld}", fs->cache.slot_count, fs->cache.hits, fs->cache.misses, fs->cache.read_ahead);
+    } else {
+        printf("null");
+    }
+    printf(", \"commands\": {");
+    for (int i = 0; i < stats.command_count; i++) {
+        COMMAND_STATS* command = &stats.commands[i];
+        printf("%s\"%s\": {\"count\": %lld, \"total_ms\": %.3f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+               i > 0 ? ", " : "", command->name, command->count, command->total_nanoseconds / 1e6, command->total_nanoseconds / 1e6 / command->count,
+               command_percentile(command, 0.5), command_percentile(command, 0.99), command->max_nanoseconds / 1e6);
+    }
+    printf("}}\n");
+    return 0;
+}
+
+// list the blocks of a file in an old format image in file order, returns -1 if the chain or extents are broken
+static int old_file_blocks(FILE* old, LEGACY_SUPERBLOCK* superblock, long data_offset, char* inode, int* blocks, int count) {
+    LEGACY_DATA_BLOCK record;
+    if (superblock->magic_number == LEGACY_MAGIC_NUMBER) {
+        int block_index = ((LEGACY_INODE*) inode)->first_block;
+        for (int i = 0; i < count; i++) {
+            if (block_index < 0 || block_index >= superblock->total_data_blocks) {
+                return -1;
+            }
+            blocks[i] = block_index;
+            fseek(old, data_offset + sizeof(LEGACY_DATA_BLOCK) * (long) block_index, SEEK_SET);
+            fread(&record, sizeof(LEGACY_DATA_BLOCK), 1, old);
+            block_index = record.next_block;
+        }
+        return 0;
+    }
+    LEGACY_EXTENT_INODE* extent_inode = (LEGACY_EXTENT_INODE*) inode;
+    EXTENT* extents = (EXTENT*) record.data;
+    int extent_block = extent_inode->extent_block;
+    int filled = 0;
+    for (int i = 0; i < extent_inode->extent_count && filled < count; i++) {
+        EXTENT extent;
+        if (i < LEGACY_INODE_EXTENTS) {
+            extent = extent_inode->extents[i];
+        } else {
+            int per_block = LEGACY_BLOCK_SIZE / sizeof(EXTENT);
+            if ((i - LEGACY_INODE_EXTENTS) % per_block == 0) {
+                if (extent_block < 0 || extent_block >= superblock->total_data_blocks) {
+                    return -1;
+                }
+                fseek(old, data_offset + sizeof(LEGACY_DATA_BLOCK) * (long) extent_block, SEEK_SET);
+                fread(&record, sizeof(LEGACY_DATA_BLOCK), 1, old);
+                extent_block = record.next_block;
+            }
+            extent = extents[(i - LEGACY_INODE_EXTENTS) % per_block];
+        }
+        if (extent.start < 0 || extent.length <= 0 || extent.start + extent.length > superblock->total_data_blocks) {
+            return -1;
+        }
+        for (int j = 0; j < extent.length && filled < count; j++) {
+            blocks[filled++] = extent.start + j;
+        }
+    }
+    return filled == count ? 0 : -1;
+}
+
+int convert_fs(char* old_name, char* fs_name) {
+    FILE* old = fopen(old_name, "r");
+    if (old == NULL) {
+        printf("Error: could not open disk file.\n");
+        return -1;
+    }
+    LEGACY_SUPERBLOCK superblock;
+    if (fread(&superblock, sizeof(LEGACY_SUPERBLOCK), 1, old) != 1
+        || (superblock.magic_number != LEGACY_MAGIC_NUMBER && superblock.magic_number != EXTENT_MAGIC_NUMBER)
+        || superblock.total_inodes <= 0 || superblock.total_data_blocks <= 0) {
+        printf("Error: file is not a file system in an old format.\n");
+        fclose(old);
+        return -1;
+    }
+    long inode_size = superblock.magic_number == LEGACY_MAGIC_NUMBER ? sizeof(LEGACY_INODE) : sizeof(LEGACY_EXTENT_INODE);
+    char* old_inodes = (char*) malloc(inode_size * superblock.total_inodes);
+    fread(old_inodes, inode_size, superblock.total_inodes, old);
+    long data_offset = sizeof(LEGACY_SUPERBLOCK) + inode_size * superblock.total_inodes;
+    // same user space, plus one block per inode since every file now rounds up to a larger block,
+    // and the root directory with its nodes at least half full
+    int block_size = DEFAULT_BLOCK_SIZE;
+    int node_entries = (block_size - sizeof(DIR_NODE)) / sizeof(DIR_ENTRY);
+    int blocks = ((long long) superblock.total_data_blocks * LEGACY_BLOCK_SIZE + block_size - 1) / block_size + superblock.total_inodes
+        + 2 * superblock.total_inodes / node_entries + 2 * (dir_depth_for(node_entries, superblock.total_inodes) + 1);
+    FS* fs = init_fs(fs_name, blocks, block_size, superblock.total_inodes + 1, NULL);
+    if (fs == NULL) {
+        free(old_inodes);
+        fclose(old);
+        return -1;
+    }
+    lock_metadata(fs, F_WRLCK); // until close_fs, the files are added without write_dirty
+    int result = 0;
+    int* old_blocks = (int*) malloc(sizeof(int) * superblock.total_data_blocks);
+    char* data = (char*) malloc((long) fs->io_blocks * block_size);
+    unsigned int* checksums = (unsigned int*) malloc(sizeof(unsigned int) * fs->io_blocks);
+    LEGACY_DATA_BLOCK record;
+    for (int i = 0; i < superblock.total_inodes; i++) {
+        char* old_inode = old_inodes + inode_size * i;
+        // both old inode layouts start with the name and the size
+        int size = superblock.magic_number == LEGACY_MAGIC_NUMBER ? ((LEGACY_INODE*) old_inode)->size : ((LEGACY_EXTENT_INODE*) old_inode)->size;
+        int is_used = superblock.magic_number == LEGACY_MAGIC_NUMBER ? ((LEGACY_INODE*) old_inode)->is_used : ((LEGACY_EXTENT_INODE*) old_inode)->is_used;
+        if (is_used != USED) {
+            continue;
+        }
+        int old_count = (size + LEGACY_BLOCK_SIZE - 1) / LEGACY_BLOCK_SIZE;
+        if (size < 0 || old_count > superblock.total_data_blocks
+            || old_file_blocks(old, &superblock, data_offset, old_inode, old_blocks, old_count) == -1) {
+            printf("Error: data of file %.31s is corrupted, skipping it.\n", old_inode);
+            result = -1;
+            continue;
+        }
+        int root = fs->superblock.root_inode;
+        int inode_index = get_free_inode(fs);
+        if (inode_index == -1) {
+            printf("Error: no available inodes.\n");
+            result = -1;
+            break;
+        }
+        INODE* inode = &fs->inodes[inode_index];
+        EXTENT_LIST* list = &fs->extents[inode_index];
+        memset(inode, 0, sizeof(INODE));
+        memcpy(inode->name, old_inode, MAX_FILE_NAME);
+        inode->name[MAX_FILE_NAME - 1] = '\0';
+        inode->type = TYPE_FILE;
+        inode->parent = root;
+        inode->extent_block = END_OF_FILE;
+        if (get_inode_by_name(fs, root, inode->name) != -1 || dir_insert(fs, root, inode->name, inode_index) == -1) {
+            printf("Error: file %s cannot be added to the root directory, skipping it.\n", inode->name);
+            result = -1;
+            continue;
+        }
+        inode->size = size;
+        list->count = 0;
+        allocate_extents(fs, (size + block_size - 1) / block_size, list);
+        store_extents(fs, inode_index);
+        // fill the new extents with the old blocks in file order
+        int next_old = 0;
+        long long bytes_left = size;
+        for (int j = 0; j < list->count; j++) {
+            for (int done = 0; done < list->extents[j].length; done += fs->io_blocks) {
+                int count = list->extents[j].length - done < fs->io_blocks ? list->extents[j].length - done : fs->io_blocks;
+                memset(data, 0, (long) count * block_size);
+                for (long position = 0; position < (long) count * block_size && bytes_left > 0; position += LEGACY_BLOCK_SIZE) {
+                    fseek(old, data_offset + sizeof(LEGACY_DATA_BLOCK) * (long) old_blocks[next_old++], SEEK_SET);
+                    fread(&record, sizeof(LEGACY_DATA_BLOCK), 1, old);
+                    long long length = bytes_left < LEGACY_BLOCK_SIZE ? bytes_left : LEGACY_BLOCK_SIZE;
+                    memcpy(data + position, record.data, length);
+                    bytes_left -= length;
+                }
+                write_blocks(fs, list->extents[j].start + done, count, data);
+                checksum_blocks(fs, data, count, checksums);
+                for (int k = 0; k < count; k++) {
+                    fs->blocks[list->extents[j].start + done + k].checksum = checksums[k];
+                    dedup_add(fs, list->extents[j].start + done + k);
+                    mark_block_dirty(fs, list->extents[j].start + done + k);
+                }
+            }
+        }
+        inode->is_used = USED;
+        index_add(fs, inode_index);
+        fs->superblock.used_user_space += size;
+        mark_inode_dirty(fs, inode_index);
+    }
+    mark_superblock_dirty(fs);
+    free(data);
+    free(checksums);
+    free(old_blocks);
+    free(old_inodes);
+    fclose(old);
+    close_fs(fs);
+    return result;
+}
+
+int get_free_inode(FS* fs) {
+    return fs->free_inode_count > 0 ? fs->free_inodes[fs->free_inode_count - 1] : -1;
+}
+
+int get_inode_by_name(FS* fs, int parent, char* file_name) {
+    for (int i = fs->name_buckets[hash_name(parent, file_name) & fs->bucket_mask]; i != -1; i = fs->name_next[i]) {
+        if (fs->inodes[i].parent == parent && strcmp(fs->inodes[i].name, file_name) == 0) {
             return i;
         }
     }
     return -1;
-}
\ No newline at end of file
+}
+
+void clear_dirty_state(FS* fs) {
+    fs->superblock_dirty = 0;
+    for (int i = 0; i < fs->dirty_inode_count; i++) {
+        fs->inode_dirty[fs->dirty_inodes[i]] = 0;
+    }
+    fs->dirty_inode_count = 0;
+    for (int i = 0; i < fs->dirty_block_count; i++) {
+        fs->block_dirty[fs->dirty_blocks[i]] = 0;
+    }
+    fs->dirty_block_count = 0;
+}
+
+void mark_superblock_dirty(FS* fs) {
+    fs->superblock_dirty = 1;
+}
+
+void mark_inode_dirty(FS* fs, int inode_index) {
+    if (fs->inode_dirty[inode_index] == 0) {
+        fs->inode_dirty[inode_index] = 1;
+        fs->dirty_inodes[fs->dirty_inode_count++] = inode_index;
+    }
+}
+
+void mark_block_dirty(FS* fs, int block_index) {
+    if (fs->block_dirty[block_index] == 0) {
+        fs->block_dirty[block_index] = 1;
+        fs->dirty_blocks[fs->dirty_block_count++] = block_index;
+    }
+}
+
+void write_dirty(FS* fs) {
+    SUPERBLOCK* superblock = &fs->superblock;
+    if (fs->superblock_dirty || fs->dirty_inode_count > 0 || fs->dirty_block_count > 0) {
+        superblock->generation++; // other processes reload the metadata when they lock it next
+        fs->superblock_dirty = 1;
+    }
+    if (fs->superblock_dirty) {
+        meta_write(fs, SUPERBLOCK_OFFSET, superblock, sizeof(SUPERBLOCK));
+    }
+    qsort(fs->dirty_inodes, fs->dirty_inode_count, sizeof(int), compare_ints);
+    for (int i = 0; i < fs->dirty_inode_count; i++) {
+        int inode_index = fs->dirty_inodes[i];
+        meta_write(fs, superblock->inodes_offset + sizeof(INODE) * (long long) inode_index, &fs->inodes[inode_index], sizeof(INODE));
+    }
+    // write the bitmap and block table pages holding the dirty blocks, each page once and in disk order
+    int words_per_page = PAGE_SIZE / sizeof(unsigned long long);
+    int entries_per_page = PAGE_SIZE / sizeof(BLOCK_META);
+    int last_map_page = -1;
+    qsort(fs->dirty_blocks, fs->dirty_block_count, sizeof(int), compare_ints);
+    for (int i = 0; i < fs->dirty_block_count; i++) {
+        int map_page = fs->dirty_blocks[i] / 64 / words_per_page;
+        if (map_page != last_map_page) {
+            int first_word = map_page * words_per_page;
+            int count = fs->map_words - first_word < words_per_page ? fs->map_words - first_word : words_per_page;
+            meta_write(fs, superblock->bitmap_offset + sizeof(unsigned long long) * (long long) first_word, &fs->free_map[first_word], sizeof(unsigned long long) * count);
+            last_map_page = map_page;
+        }
+    }
+    int last_table_page = -1;
+    for (int i = 0; i < fs->dirty_block_count; i++) {
+        int table_page = fs->dirty_blocks[i] / entries_per_page;
+        if (table_page != last_table_page) {
+            int first_entry = table_page * entries_per_page;
+            int count = superblock->total_data_blocks - first_entry < entries_per_page ? superblock->total_data_blocks - first_entry : entries_per_page;
+            meta_write(fs, superblock->block_table_offset + sizeof(BLOCK_META) * (long long) first_entry, &fs->blocks[first_entry], sizeof(BLOCK_META) * count);
+            last_table_page = table_page;
+        }
+    }
+    clear_dirty_state(fs);
+    if (!journal_enabled(fs)) {
+        if (fs->map != NULL) {
+            msync(fs->map, superblock->total_size, MS_SYNC); // commit point of the mmap backend
+            count_stat(&stats.sync_calls, 1);
+        }
+        punch_freed_blocks(fs);
+        return;
+    }
+    // group commit - the batch goes to the journal when it is full, when it frees blocks that the next operations could
+    // overwrite before it is durable, or when it takes up half of the journal
+    JOURNAL* journal = &fs->journal;
+    journal->pending_operations++;
+    if (journal->pending_operations >= journal->batch || journal->blocks_freed || journal->used > superblock->journal_size / 2) {
+        journal_commit(fs);
+    }
+}
@@ -1,28 +1,138 @@
-#define MAX_FILES 16
+#include <stdio.h>
+#include <pthread.h>
+#include "compress.h"
+
+#define DEFAULT_INODES 16
+#define MAX_INODES (1 << 24)
 #define MAX_FILE_NAME 32
-#define BLOCK_SIZE 1024
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1 << 20)
+#define PAGE_SIZE 4096 // metadata regions and the data area start on page boundaries
+#define INODE_EXTENTS 16 // extents stored in the inode, the rest go to extent blocks
+#define EXTENTS_PER_BLOCK(fs) ((fs)->superblock.block_size / (int) sizeof(EXTENT))
+#define IO_SIZE (1 << 20) // bytes transferred per read or write call when moving file data
+#define TRANSFER_SIZE (16 << 20) // largest piece of a file copied by one worker thread
+#define MAX_THREADS 64
 #define SUPERBLOCK_OFFSET 0
-#define INODES_OFFSET sizeof(SUPERBLOCK)
-#define DATA_OFFSET (sizeof(INODE) * MAX_FILES) + INODES_OFFSET
 #define NOT_USED 0
 #define USED 1
 #define END_OF_FILE -1
-#define MAGIC_NUMBER 0x5016e171
+#define MAGIC_NUMBER 0x5016e173
+#define EXTENT_MAGIC_NUMBER 0x5016e172 // 1 KiB block records with extent inodes, see convert_fs
+#define LEGACY_MAGIC_NUMBER 0x5016e171 // 1 KiB block records with files stored as linked block chains, see convert_fs
+#define FEATURE_DIRECTORIES 0x1 // root_inode holds the root directory, older images are upgraded when selected
+#define FEATURE_JOURNAL 0x2 // metadata changes go through the journal region, images created without it are written in place
+#define FEATURE_COMPRESSION 0x4 // set once a compressed file is written, see INODE codec
+#define FEATURE_DEDUP 0x8 // set once files share a data block, see BLOCK_META extra_refs
+#define KNOWN_FEATURES (FEATURE_DIRECTORIES | FEATURE_JOURNAL | FEATURE_COMPRESSION | FEATURE_DEDUP)
+#define TYPE_FILE 0
+#define TYPE_DIRECTORY 1
+#define BACKEND_FILE 0 // disk file accessed with pread and pwrite
+#define BACKEND_MMAP 1 // disk file mapped into memory, data blocks accessed in place
+#define DEFAULT_BATCH 1 // operations per journal commit
+#define JOURNAL_MIN_SIZE (1 << 20)
+#define JOURNAL_MAGIC_NUMBER 0x5016e1a0
+#define TRANSACTION_MAGIC_NUMBER 0x5016e1a1
+#define JOURNAL_BUCKETS (1 << 14)
+#define DEFAULT_CACHE_SIZE 64 // MiB of data blocks kept in memory with the file backend
+#define READAHEAD_SIZE (1 << 20) // most bytes read ahead of a sequential read
+#define COMPRESS_CHUNK (64 << 10) // bytes of a file compressed together, a read decodes whole chunks
+#define DEDUP_BUCKETS (1 << 16) // hash buckets of the blocks a copy writes, see dedup_file
+#define MAX_STAT_COMMANDS 32
+#define LATENCY_BUCKETS 48 // command timings by the power of two of their nanoseconds
 
-typedef struct data_block {
-    int is_used;
-    char data[BLOCK_SIZE];
-    int next_block;
-} DATA_BLOCK;
+// on-disk layout: superblock page, free-block bitmap, block table, inode table, journal, then block_size data blocks
+typedef struct superblock {
+    int magic_number;
+    int total_inodes;
+    int total_data_blocks;
+    int block_size;
+    long long total_size;
+    long long user_space;
+    long long used_user_space;
+    long long bitmap_offset;
+    long long block_table_offset;
+    long long inodes_offset;
+    long long data_offset;
+    int features; // FEATURE_ flags, 0 on images created before the flags were introduced
+    int root_inode;
+    long long journal_offset;
+    long long journal_size; // 0 when the image has no journal
+    long long generation; // bumped by every write_dirty that changes something, tells other processes to reload the metadata
+    int reserved[38];
+} SUPERBLOCK;
+
+typedef struct extent {
+    int start; // first data block of the run
+    int length; // number of data blocks in the run
+} EXTENT;
 
 typedef struct inode {
     char name[MAX_FILE_NAME];
-    int size;
-    int first_block;
+    long long size;
     int is_used;
+    int extent_count;
+    int extent_block; // first block of the chain holding the extents past INODE_EXTENTS
+    int type; // TYPE_FILE or TYPE_DIRECTORY
+    int parent; // inode of the directory holding the entry, the root directory is its own parent
+    int codec; // CODEC_ the data is compressed with, CODEC_NONE for data stored as it is
+    long long stored_size; // bytes of data blocks a compressed file uses, its frame table included
+    int reserved[14];
+    EXTENT extents[INODE_EXTENTS];
 } INODE;
 
-typedef struct superblock {
+typedef struct block_meta {
+    int next_block; // next block of an extent block chain
+    int extra_refs; // files sharing the data block besides the first one, the block is freed when the last one lets go of it
+    unsigned int checksum; // CRC32C of the data of a file block, checked when it is read - 0 for other blocks and blocks written before checksums were kept
+    int reserved;
+} BLOCK_META; // block table entry, kept in memory while the file system is selected
+
+// directories are B+ trees with one node per data block of the directory, nodes refer to each other by logical block
+// so the directory can be moved like any other file - the root node is always logical block 0
+typedef struct dir_node {
+    int is_leaf;
+    int count;
+    int next_leaf; // logical block of the next leaf in name order, END_OF_FILE for the last leaf
+    int reserved;
+} DIR_NODE; // followed by count DIR_ENTRY records sorted by name
+
+typedef struct dir_entry {
+    char name[MAX_FILE_NAME];
+    int inode; // inode of the entry in a leaf, logical block of the child holding names from this one on in an inner node
+} DIR_ENTRY;
+
+#define DIR_NODE_ENTRIES(fs) (((fs)->superblock.block_size - (int) sizeof(DIR_NODE)) / (int) sizeof(DIR_ENTRY))
+#define DIR_MAX_DEPTH 16
+
+// the journal region starts with a header page followed by committed transactions, each one a TRANSACTION and its records
+typedef struct journal_header {
+    int magic_number;
+    unsigned int sequence; // sequence of the first transaction after the header, older ones are already in place
+    int reserved[14];
+} JOURNAL_HEADER;
+
+typedef struct transaction {
+    int magic_number;
+    unsigned int sequence;
+    int record_count;
+    unsigned int checksum; // CRC32C of the whole transaction with this field set to 0
+    long long length; // bytes of the transaction including this header
+    long long reserved;
+} TRANSACTION;
+
+typedef struct journal_record {
+    long long offset; // where the data goes in the disk file
+    int length;
+    int reserved;
+} JOURNAL_RECORD; // followed by length bytes of data, padded to 8 bytes
+
+// formats read by convert_fs
+#define LEGACY_BLOCK_SIZE 1024
+#define LEGACY_INODE_EXTENTS 8
+
+typedef struct legacy_superblock {
     int magic_number;
     int total_size;
     int total_inodes;
@@ -30,17 +140,190 @@ typedef struct superblock {
     int user_space;
     int used_user_space;
     int block_size;
-} SUPERBLOCK;
+} LEGACY_SUPERBLOCK;
+
+typedef struct legacy_data_block {
+    int is_used;
+    char data[LEGACY_BLOCK_SIZE];
+    int next_block;
+} LEGACY_DATA_BLOCK;
+
+typedef struct legacy_inode {
+    char name[MAX_FILE_NAME];
+    int size;
+    int first_block;
+    int is_used;
+} LEGACY_INODE;
+
+typedef struct legacy_extent_inode {
+    char name[MAX_FILE_NAME];
+    int size;
+    int is_used;
+    int extent_count;
+    int extent_block;
+    EXTENT extents[LEGACY_INODE_EXTENTS];
+} LEGACY_EXTENT_INODE;
+
+typedef struct extent_list {
+    EXTENT* extents;
+    int* first_logical; // index of the first file block in each extent, for binary search by offset
+    int count;
+    int capacity;
+} EXTENT_LIST;
+
+// settings of the next init or select, they are not stored in the disk file
+typedef struct fs_options {
+    int backend;
+    int batch; // operations per journal commit
+    int threads; // threads copying file data, 0 for one per processor
+    int cache_size; // MiB of block cache, 0 to read the disk file directly
+    int compress; // CODEC_ of the files copied in
+    int dedup; // files copied in share the blocks that hold the same data as blocks already stored
+} FS_OPTIONS;
+
+// timings of one command, see record_command
+typedef struct command_stats {
+    char name[MAX_FILE_NAME];
+    long long count;
+    long long total_nanoseconds;
+    long long max_nanoseconds;
+    long long buckets[LATENCY_BUCKETS]; // bucket k counts the commands that took from 2^k to 2^(k+1) nanoseconds
+} COMMAND_STATS;
+
+// work done by the process on every file system it selected since it started or reset_stats, print_stats writes it as JSON
+typedef struct fs_stats {
+    long long read_calls; // pread calls, on the disk file and on the files copied in and out
+    long long bytes_read;
+    long long write_calls; // pwrite calls
+    long long bytes_written;
+    long long copy_calls; // copy_file_range and sendfile calls, the data they move never leaves the kernel
+    long long bytes_copied;
+    long long sync_calls; // fdatasync and msync calls
+    long long punch_calls; // fallocate calls that give freed blocks back to the host
+    long long blocks_scanned; // bitmap positions the free-block search looked at
+    long long blocks_allocated;
+    long long blocks_freed;
+    long long blocks_shared; // blocks deduplication found already stored
+    long long bytes_checksummed;
+    long long checksum_errors;
+    long long journal_commits;
+    long long journal_bytes;
+    long long metadata_reloads; // another process changed the file system
+    COMMAND_STATS commands[MAX_STAT_COMMANDS];
+    int command_count;
+} FS_STATS;
+
+// data blocks read from the disk file, evicted in least recently used order
+typedef struct block_cache {
+    char* data; // slot_count slots of block_size bytes
+    int slot_count;
+    int* slot_block; // data block held by each slot, -1 when the slot is empty
+    int* newer; // slots chained from the least recently used (oldest) to the most recently used (newest)
+    int* older;
+    int oldest;
+    int newest;
+    int* buckets; // slots hashed by data block, chained through bucket_next
+    int* bucket_next;
+    int bucket_mask;
+    int next_block; // block after the last read, a miss there is sequential
+    int window; // blocks the next sequential miss reads ahead
+    long long hits;
+    long long misses;
+    long long read_ahead; // blocks read before they were asked for
+    pthread_mutex_t lock; // transfer threads read through the cache in parallel
+} BLOCK_CACHE;
+
+// transaction being built - the metadata written by the operations since the last commit, in the layout it gets in the journal
+typedef struct journal {
+    char* buffer;
+    long long used;
+    long long capacity;
+    int record_count;
+    long long* record_positions; // offset of each record in buffer
+    int* record_next; // records chained by hash of their disk offset, so later writes replace earlier ones and reads see them
+    int record_capacity;
+    int* buckets;
+    long long head; // offset in the journal region where the next transaction goes
+    unsigned int sequence; // sequence of the next transaction
+    unsigned int base; // sequence in the journal header when this process last saw it, see refresh_metadata
+    int pending_operations;
+    int batch;
+    int blocks_freed; // blocks freed by the pending operations must not be overwritten before the commit
+} JOURNAL;
+
+typedef struct fs {
+    int fd;
+    char* map; // whole disk file when the mmap backend is used, NULL otherwise
+    SUPERBLOCK superblock;
+    INODE* inodes;
+    EXTENT_LIST* extents; // full extent list of every inode
+    BLOCK_META* blocks;
+    int io_blocks; // data blocks per IO_SIZE transfer
+    int threads; // threads copying file data, see run_transfers
+    int compress; // CODEC_ of the files copied in
+    int dedup;
+    // free-block bitmap, one bit per data block, set when the block is used
+    unsigned long long* free_map;
+    int map_words;
+    int free_blocks;
+    int* punch_blocks; // blocks freed since the last commit, their space goes back to the host once it is durable
+    int punch_count;
+    int punch_capacity;
+    // dirty tracking - only the records changed by a mutation are written back to the disk file
+    int superblock_dirty;
+    char* inode_dirty; // one flag per inode
+    int* dirty_inodes; // indices of dirty inodes
+    int dirty_inode_count;
+    char* block_dirty; // one flag per data block, set when its bitmap bit or block table entry changed
+    int* dirty_blocks; // indices of dirty data blocks
+    int dirty_block_count;
+    // name index - hash buckets of used inodes keyed by parent directory and name, chained through name_next, rebuilt when the file system is selected
+    int* name_buckets;
+    int* name_next;
+    int bucket_mask;
+    int* free_inodes; // stack of unused inodes, the lowest index on top
+    // deduplication index - hash buckets of the data blocks with a checksum keyed by it, chained through dedup_next, NULL while dedup is off
+    int* dedup_buckets;
+    int* dedup_next;
+    int dedup_mask;
+    int free_inode_count;
+    // files in the order defragment_fs lays them out, kept until an incremental pass is finished
+    int* defrag_order;
+    int defrag_count;
+    JOURNAL journal;
+    BLOCK_CACHE cache;
+    int metadata_lock; // F_UNLCK, F_RDLCK or F_WRLCK on the superblock page, see lock_metadata
+} FS;
+
+FS* init_fs(char* fs_name, int blocks, int block_size, int inodes, FS_OPTIONS* options);
+FS* select_fs(char* fs_name, FS_OPTIONS* options);
+void close_fs(FS* fs);
+int sync_fs(FS* fs);
+int resize_cache(FS* fs, int megabytes);
+int set_dedup(FS* fs, int on);
+int copy_file_to_fs(FS* fs, char* path_to_file, char* fs_path);
+int copy_files_to_fs(FS* fs, char** paths, int count, char* fs_path);
+int copy_file_from_fs(FS* fs, char* file_path, char* output_path);
+int copy_files_from_fs(FS* fs, char** paths, int count, char* output_directory);
+long long read_file_at(FS* fs, char* file_path, long long offset, char* buffer, long long length);
+int list_files(FS* fs, char* directory_path);
+int delete_file(FS* fs, char* file_path);
+int make_directory(FS* fs, char* directory_path);
+int remove_directory(FS* fs, char* directory_path);
+int defragment_fs(FS* fs, int max_blocks);
+int scrub_fs(FS* fs);
+int delete_fs(char* fs_name);
+int usage_map(FS* fs);
+int convert_fs(char* old_name, char* fs_name);
+void record_command(char* name, long long nanoseconds);
+void reset_stats(void);
+int print_stats(FS* fs);
+
+int get_free_inode(FS* fs);
+int get_inode_by_name(FS* fs, int parent, char* file_name);
 
-void init_fs(char* fs_name, int blocks);
-void select_fs(char* fs_name);
-void copy_file_to_fs(char* fs_name, char* path_to_file);
-void copy_file_from_fs(char* fs_name, char* file_name, char* output_path);
-void list_files(char* fs_name);
-void delete_file(char* fs_name, char* file_name);
-void defragment_fs(char* fs_name);
-void delete_fs(char* fs_name);
-void usage_map(char* fs_name);
-
-int get_free_inode();
-int get_inode_by_name(char* file_name);
\ No newline at end of file
+void clear_dirty_state(FS* fs);
+void mark_superblock_dirty(FS* fs);
+void mark_inode_dirty(FS* fs, int inode_index);
+void mark_block_dirty(FS* fs, int block_index);
+void write_dirty(FS* fs);
@@ -2,13 +2,120 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
 
-int main(int argc, char** argv) {
-    char command[256];
-    char filename[256] = "";
-    char source[256];
-    char destination[256];
-    int blocks;
+#define MAX_LINE 65536
+#define MAX_WORDS 4096
+
+// commands come from the terminal, from a script (-f script, or stdin that is not a terminal) or from the arguments,
+// a command and its arguments may share a line and the arguments may also follow on the next lines, except optional ones
+static FILE* input;
+static char** argument_lines; // one command line per argument, NULL when reading input
+static int argument_count;
+static char line[MAX_LINE];
+static char* cursor = line;
+static int interactive;
+static long long input_nanoseconds; // spent waiting for input, left out of the command timings
+
+static long long now_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int read_line(void) {
+    if (argument_lines != NULL) {
+        if (argument_count == 0) {
+            return 0;
+        }
+        strncpy(line, *argument_lines++, MAX_LINE - 1);
+        line[MAX_LINE - 1] = '\0';
+        argument_count--;
+    } else {
+        long long started = now_nanoseconds();
+        char* read = fgets(line, MAX_LINE, input);
+        input_nanoseconds += now_nanoseconds() - started;
+        if (read == NULL) {
+            return 0;
+        }
+    }
+    cursor = line;
+    return 1;
+}
+
+// next word of the input into word (256 bytes), returns 0 at the end of the input
+static int read_word(char* word) {
+    cursor += strspn(cursor, " \t\r\n");
+    while (*cursor == '\0') {
+        if (!read_line()) {
+            word[0] = '\0';
+            return 0;
+        }
+        cursor += strspn(cursor, " \t\r\n");
+    }
+    int length = strcspn(cursor, " \t\r\n");
+    snprintf(word, 256, "%.*s", length, cursor);
+    cursor += length;
+    return 1;
+}
+
+static int read_number(void) {
+    char word[256];
+    read_word(word);
+    return atoi(word);
+}
+
+// an optional argument into word (256 bytes), only from the current line so a missing one does not take the next command -
+// someone typing the commands answers the prompt on the next line, word is default_word when the argument is left out
+static void read_optional_word(char* word, const char* default_word) {
+    cursor += strspn(cursor, " \t\r\n");
+    if (*cursor == '\0' && interactive && read_line()) {
+        cursor += strspn(cursor, " \t\r\n");
+    }
+    int length = strcspn(cursor, " \t\r\n");
+    if (length == 0) {
+        snprintf(word, 256, "%s", default_word);
+    } else {
+        snprintf(word, 256, "%.*s", length, cursor);
+    }
+    cursor += length;
+}
+
+// the words left on the current line, or on the next line when it has none, returns their count
+static int read_words(char** words, int max_words) {
+    cursor += strspn(cursor, " \t\r\n");
+    if (*cursor == '\0' && !read_line()) {
+        return 0;
+    }
+    int count = 0;
+    while (count < max_words) {
+        cursor += strspn(cursor, " \t\r\n");
+        if (*cursor == '\0') {
+            break;
+        }
+        words[count++] = cursor;
+        cursor += strcspn(cursor, " \t\r\n");
+        if (*cursor != '\0') {
+            *cursor++ = '\0';
+        }
+    }
+    return count;
+}
+
+// prompts are only shown to someone typing the commands
+static void prompt(const char* format, ...) {
+    if (!interactive) {
+        return;
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+}
+
+static void print_commands(void) {
     printf("Available commands:\n");
     printf("init\n");
     printf("select\n");
@@ -16,68 +123,199 @@ int main(int argc, char** argv) {
     printf("get\n");
     printf("list\n");
     printf("remove\n");
+    printf("mkdir\n");
+    printf("rmdir\n");
     printf("info\n");
     printf("defrag\n");
+    printf("scrub\n");
     printf("delete\n");
-    printf("exit\n\n\n");
+    printf("convert\n");
+    printf("set\n");
+    printf("sync\n");
+    printf("stats\n");
+    printf("exit\n");
+}
+
+int main(int argc, char** argv) {
+    char command[256];
+    char filename[256] = "";
+    char source[256];
+    char destination[256];
+    char* words[MAX_WORDS];
+    int blocks, block_size, inodes;
+    int failed = 0; // exit status of a script
+    FS* fs = NULL; // file system selected for the session
+    FS_OPTIONS options = {BACKEND_FILE, DEFAULT_BATCH, 0, DEFAULT_CACHE_SIZE, CODEC_NONE, 0}; // applied by the next init or select
+    input = stdin;
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        input = fopen(argv[2], "r");
+        if (input == NULL) {
+            printf("Error: could not open script %s.\n", argv[2]);
+            return 1;
+        }
+    } else if (argc > 1) {
+        argument_lines = argv + 1;
+        argument_count = argc - 1;
+    }
+    interactive = argc == 1 && isatty(STDIN_FILENO);
+    if (interactive) {
+        print_commands();
+        printf("\n\n");
+    }
     while (1) {
-        printf("%s> ", filename);
-        scanf("%255s", command);
+        prompt("%s> ", filename);
+        if (!read_word(command)) {
+            close_fs(fs); // end of the script
+            break;
+        }
+        int result = 0;
+        int timed = 1; // unknown commands are not timed
+        long long started = now_nanoseconds();
+        long long waited = input_nanoseconds;
         if (strcmp(command, "init") == 0) {
-            printf("Enter the name of the file system to create: ");
-            scanf("%255s", filename);
-            printf("Enter the number of data blocks in the file system: ");
-            scanf("%d", &blocks);
-            init_fs(filename, blocks);
+            prompt("Enter the name of the file system to create: ");
+            read_word(filename);
+            prompt("Enter the number of data blocks in the file system: ");
+            blocks = read_number();
+            prompt("Enter the block size in bytes (power of two, %d to %d): ", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+            block_size = read_number();
+            prompt("Enter the number of inodes: ");
+            inodes = read_number();
+            close_fs(fs);
+            fs = init_fs(filename, blocks, block_size, inodes, &options);
+            if (fs == NULL) {
+                filename[0] = '\0';
+                result = -1;
+            }
         } else if (strcmp(command, "select") == 0) {
-            printf("Enter the name of the file system to select: ");
-            scanf("%255s", filename);
-            select_fs(filename);
+            prompt("Enter the name of the file system to select: ");
+            read_word(filename);
+            close_fs(fs);
+            fs = select_fs(filename, &options);
+            if (fs == NULL) {
+                filename[0] = '\0';
+                result = -1;
+            }
         } else if (strcmp(command, "copy") == 0) {
-            printf("Enter the name of the file to copy to the file system: ");
-            scanf("%255s", source);
-            copy_file_to_fs(filename, source);
+            prompt("Enter the files or directories to copy to the file system and the destination path: ");
+            int count = read_words(words, MAX_WORDS);
+            if (count < 2) {
+                printf("Error: missing destination path.\n");
+                result = -1;
+            } else {
+                result = copy_files_to_fs(fs, words, count - 1, words[count - 1]);
+            }
         } else if (strcmp(command, "get") == 0) {
-            printf("Enter the name of the file to get from the file system and the destination filename: ");
-            scanf("%255s %255s", source, destination);
-            copy_file_from_fs(filename, source, destination);
+            prompt("Enter the files or directories to get from the file system and the destination path: ");
+            int count = read_words(words, MAX_WORDS);
+            if (count < 2) {
+                printf("Error: missing destination path.\n");
+                result = -1;
+            } else {
+                result = copy_files_from_fs(fs, words, count - 1, words[count - 1]);
+            }
         } else if (strcmp(command, "list") == 0) {
-            list_files(filename);
+            prompt("Enter the directory to list (/ if left empty): ");
+            read_optional_word(source, "/");
+            result = list_files(fs, source);
         } else if (strcmp(command, "remove") == 0) {
-            printf("Enter the name of the file to remove from the file system: ");
-            scanf("%255s", source);
-            delete_file(filename, source);
+            prompt("Enter the name of the file to remove from the file system: ");
+            read_word(source);
+            result = delete_file(fs, source);
+        } else if (strcmp(command, "mkdir") == 0) {
+            prompt("Enter the path of the directory to create: ");
+            read_word(source);
+            result = make_directory(fs, source);
+        } else if (strcmp(command, "rmdir") == 0) {
+            prompt("Enter the path of the directory to remove: ");
+            read_word(source);
+            result = remove_directory(fs, source);
         } else if (strcmp(command, "info") == 0) {
-            usage_map(filename);
+            result = usage_map(fs);
         } else if (strcmp(command, "defrag") == 0) {
-            defragment_fs(filename);
+            prompt("Enter the maximum number of blocks to move (0 or empty for all): ");
+            read_optional_word(source, "0");
+            blocks = atoi(source);
+            result = defragment_fs(fs, blocks);
+        } else if (strcmp(command, "scrub") == 0) {
+            result = scrub_fs(fs);
         } else if (strcmp(command, "delete") == 0) {
-            printf("Enter the name of the file system to delete: ");
-            char current_filename[256];
-            strcpy(current_filename, filename);
-            scanf("%255s", filename);
-            delete_fs(filename);
-            if (strcmp(current_filename, filename) == 0)
+            prompt("Enter the name of the file system to delete: ");
+            char fs_to_delete[256];
+            read_word(fs_to_delete);
+            if (strcmp(fs_to_delete, filename) == 0) {
+                // the selected file system has to be closed before its disk file is removed
+                close_fs(fs);
+                fs = NULL;
                 filename[0] = '\0';
-            else
-                strcpy(filename, current_filename);
+            }
+            result = delete_fs(fs_to_delete);
+        } else if (strcmp(command, "convert") == 0) {
+            prompt("Enter the name of the file system in the old format and the name of the converted file system: ");
+            read_word(source);
+            read_word(destination);
+            result = convert_fs(source, destination);
+        } else if (strcmp(command, "set") == 0) {
+            prompt("Enter the option and its value (backend file|mmap, batch operations per commit, threads count or 0 for one per processor, cache MiB or 0 for none, compress none|fast|high, dedup on|off): ");
+            read_word(source);
+            read_word(destination);
+            if (strcmp(source, "backend") == 0 && strcmp(destination, "file") == 0) {
+                options.backend = BACKEND_FILE;
+            } else if (strcmp(source, "backend") == 0 && strcmp(destination, "mmap") == 0) {
+                options.backend = BACKEND_MMAP;
+            } else if (strcmp(source, "batch") == 0 && atoi(destination) > 0) {
+                options.batch = atoi(destination);
+                if (fs != NULL) {
+                    sync_fs(fs); // the new batch size starts with an empty batch
+                    fs->journal.batch = options.batch;
+                }
+            } else if (strcmp(source, "threads") == 0 && atoi(destination) >= 0) {
+                options.threads = atoi(destination);
+                if (fs != NULL) {
+                    fs->threads = options.threads > 0 ? options.threads : sysconf(_SC_NPROCESSORS_ONLN);
+                    fs->threads = fs->threads < 1 ? 1 : fs->threads > MAX_THREADS ? MAX_THREADS : fs->threads;
+                }
+            } else if (strcmp(source, "cache") == 0 && atoi(destination) >= 0) {
+                options.cache_size = atoi(destination);
+                if (fs != NULL) {
+                    resize_cache(fs, options.cache_size);
+                }
+            } else if (strcmp(source, "compress") == 0 && (strcmp(destination, "none") == 0 || strcmp(destination, "fast") == 0 || strcmp(destination, "high") == 0)) {
+                options.compress = strcmp(destination, "fast") == 0 ? CODEC_FAST : strcmp(destination, "high") == 0 ? CODEC_HIGH : CODEC_NONE;
+                if (fs != NULL) {
+                    fs->compress = options.compress;
+                }
+            } else if (strcmp(source, "dedup") == 0 && (strcmp(destination, "on") == 0 || strcmp(destination, "off") == 0)) {
+                options.dedup = strcmp(destination, "on") == 0;
+                if (fs != NULL) {
+                    set_dedup(fs, options.dedup);
+                }
+            } else {
+                printf("Error: unknown option.\n");
+                result = -1;
+            }
+        } else if (strcmp(command, "sync") == 0) {
+            result = sync_fs(fs);
+        } else if (strcmp(command, "stats") == 0) {
+            result = print_stats(fs);
         } else if (strcmp(command, "exit") == 0) {
+            close_fs(fs);
             break;
         } else {
             printf("Unknown command: %s\n", command);
-            printf("Available commands:\n");
-            printf("init\n");
-            printf("select\n");
-            printf("copy\n");
-            printf("get\n");
-            printf("list\n");
-            printf("remove\n");
-            printf("info\n");
-            printf("defrag\n");
-            printf("delete\n");
-            printf("exit\n");
+            print_commands();
+            result = -1;
+            timed = 0;
+        }
+        if (timed) {
+            record_command(command, now_nanoseconds() - started - (input_nanoseconds - waited));
+        }
+        if (result == -1) {
+            failed = 1;
         }
     }
-
-    return 0;
-}
\ No newline at end of file
+    if (input != stdin) {
+        fclose(input);
+    }
+    return failed;
+}